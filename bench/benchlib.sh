@@ -0,0 +1,70 @@
+#!/bin/sh
+
+# Paths to executables
+
+lbts=$PWD/src/lbts
+geninstance=$PWD/bench/geninstance
+
+# Parameters, can be overridden from the environment
+
+scale=${LIGHTBTS_BENCH_SCALE:-1000}       # total number of messages
+runs=${LIGHTBTS_BENCH_RUNS:-5}            # number of times each command is run
+results=${LIGHTBTS_BENCH_RESULTS:-$PWD/bench/results.json}
+
+bugs=$((scale / 4))
+replies=3
+
+# The generated instance is shared by all benchmarks of the same scale
+
+instance=$PWD/bench/instance-$scale
+scriptname=`basename $0 .bench`
+workdir=$PWD/bench/$scriptname.dir
+rm -rf $workdir
+mkdir $workdir
+cd $workdir
+
+export LIGHTBTS_PAGER=cat
+
+# Exit on errors
+
+set -e
+
+now() {
+	date +%s.%N
+}
+
+# Create the shared instance if it does not exist yet.
+make_instance() {
+	test -e "$instance/.complete" && return
+	rm -rf "$instance"
+	mkdir "$instance"
+	$geninstance --bugs $bugs --replies $replies > "$instance.mbox"
+	$lbts -d "$instance" init > /dev/null
+	$lbts -d "$instance" --no-hooks --no-email --bulk import "$instance.mbox"
+	rm "$instance.mbox"
+	touch "$instance/.complete"
+}
+
+# Record a result as one line of JSON, both on stdout and in the results file.
+report() {
+	line=$(printf '{"benchmark": "%s", "name": "%s", "scale": %s, "runs": %s, "min": %s, "mean": %s, "max": %s}' \
+		"$scriptname" "$1" "$scale" "$2" "$3" "$4" "$5")
+	echo "$line"
+	echo "$line" >> "$results"
+}
+
+# Run a shell command $runs times against the shared instance, and report its wall clock time in seconds.
+# The variable $run contains the number of the current run, starting at 1.
+bench() {
+	name=$1
+	shift
+	rm -f times
+	run=1
+	while [ $run -le $runs ]; do
+		start=$(now)
+		eval "$@" > /dev/null
+		echo "$start $(now)" >> times
+		run=$((run + 1))
+	done
+	report "$name" $runs $(awk '{t = $2 - $1} NR == 1 || t < min {min = t} t > max {max = t} {sum += t} END {printf "%.6f %.6f %.6f", min, sum / NR, max}' times)
+}
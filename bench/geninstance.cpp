@@ -0,0 +1,172 @@
+/* LightBTS -- a lightweight issue tracking system
+   Copyright © 2018 Guus Sliepen <guus@lightbts.info>
+
+   SPDX-License-Identifier: GPL-3.0+
+*/
+
+/* Generates an mbox with synthetic bug reports and replies, to be imported with lbts import --bulk.
+ * The same options and seed always produce the same mbox.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <getopt.h>
+#include <random>
+#include <string>
+#include <vector>
+#include <fmt/format.h>
+
+using namespace std;
+using namespace fmt;
+
+static const char *words[] = {
+	"crash", "when", "opening", "the", "file", "dialog", "after", "resizing", "window", "memory",
+	"leak", "in", "parser", "wrong", "output", "for", "empty", "input", "slow", "startup",
+	"with", "many", "tickets", "missing", "translation", "button", "does", "not", "work", "on",
+	"large", "screens", "timeout", "connecting", "to", "server", "invalid", "UTF-8", "handling", "mail",
+};
+
+static const char *severities[] = {
+	"wishlist", "minor", "normal", "normal", "normal", "important", "serious", "critical", "grave",
+};
+
+static const char *link_types[] = {
+	"Relates", "Duplicates", "Depends", "Blocks",
+};
+
+static void usage(const char *argv0) {
+	print(stderr,
+	      "Usage: {} [options]\n"
+	      "\n"
+	      "  -b, --bugs=N      Number of bugs (default 1000).\n"
+	      "  -r, --replies=N   Number of replies per bug (default 3).\n"
+	      "  -t, --tags=N      Number of distinct tags (default 20).\n"
+	      "  -V, --versions=N  Number of distinct versions (default 10).\n"
+	      "  -l, --links=N     Percentage of bugs linked to an older bug (default 10).\n"
+	      "  -s, --seed=N      Seed for the random number generator (default 1).\n",
+	      argv0);
+}
+
+int main(int argc, char *argv[]) {
+	size_t bugs = 1000;
+	size_t replies = 3;
+	size_t tags = 20;
+	size_t versions = 10;
+	unsigned int links = 10;
+	unsigned long seed = 1;
+
+	static const struct option long_options[] = {
+		{"bugs", required_argument, nullptr, 'b'},
+		{"replies", required_argument, nullptr, 'r'},
+		{"tags", required_argument, nullptr, 't'},
+		{"versions", required_argument, nullptr, 'V'},
+		{"links", required_argument, nullptr, 'l'},
+		{"seed", required_argument, nullptr, 's'},
+		{"help", no_argument, nullptr, 'h'},
+		{nullptr, 0, nullptr, 0},
+	};
+
+	int r;
+	while ((r = getopt_long(argc, argv, "b:r:t:V:l:s:h", long_options, nullptr)) != EOF) {
+		switch (r) {
+		case 'b': bugs = strtoul(optarg, nullptr, 10); break;
+		case 'r': replies = strtoul(optarg, nullptr, 10); break;
+		case 't': tags = strtoul(optarg, nullptr, 10); break;
+		case 'V': versions = strtoul(optarg, nullptr, 10); break;
+		case 'l': links = strtoul(optarg, nullptr, 10); break;
+		case 's': seed = strtoul(optarg, nullptr, 10); break;
+		case 'h': usage(argv[0]); return 0;
+		default: usage(argv[0]); return 1;
+		}
+	}
+
+	if (optind < argc || !bugs) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	mt19937_64 rng(seed);
+	auto random = [&](size_t n) { return uniform_int_distribution<size_t>(0, n - 1)(rng); };
+	auto chance = [&](unsigned int percent) { return random(100) < percent; };
+
+	auto sentence = [&](size_t n) {
+		string text;
+		for (size_t i = 0; i < n; i++) {
+			if (i)
+				text += ' ';
+			text += words[random(sizeof words / sizeof *words)];
+		}
+		return text;
+	};
+
+	auto version = [&] { return format("1.{}", random(versions)); };
+
+	// Messages are one minute apart, starting at 2018-01-01 00:00:00 UTC.
+	time_t date = 1514764800;
+	vector<size_t> reply_count(bugs);
+
+	auto message = [&](size_t bug, bool reply) {
+		char buf[64];
+		struct tm tm;
+		gmtime_r(&date, &tm);
+		strftime(buf, sizeof buf, "%a %b %e %H:%M:%S %Y", &tm);
+		print("From geninstance {}\n", buf);
+		strftime(buf, sizeof buf, "%a, %d %b %Y %H:%M:%S +0000", &tm);
+		date += 60;
+
+		size_t user = random(bugs / 10 + 1);
+		print("From: User {0} <user{0}@example.org>\n", user);
+		print("To: LightBTS <bugs@example.org>\n");
+		print("Date: {}\n", buf);
+		print("Message-ID: <{}.{}@geninstance>\n", bug, reply ? ++reply_count[bug] : 0);
+
+		if (reply) {
+			print("Subject: Re: Bug {}\n", bug + 1);
+			print("In-Reply-To: <{}.0@geninstance>\n", bug);
+		} else {
+			print("Subject: {}\n", sentence(3 + random(6)));
+		}
+
+		print("\n");
+
+		// Pseudo-header fields, most of them on the initial report.
+		if (!reply) {
+			print("Severity: {}\n", severities[random(sizeof severities / sizeof *severities)]);
+			if (tags && chance(75)) {
+				print("Tags:");
+				for (size_t i = 1 + random(3); i > 0; i--)
+					print(" tag{}", random(tags));
+				print("\n");
+			}
+			if (versions)
+				print("Found: {}\n", version());
+			if (bug && chance(links))
+				print("{}: {}\n", link_types[random(4)], random(bug) + 1);
+		} else if (chance(20)) {
+			print("Status: {}\n", chance(75) ? "closed" : "open");
+			if (versions && chance(50))
+				print("Fixed: {}\n", version());
+		} else if (tags && chance(10)) {
+			print("Tags: +tag{}\n", random(tags));
+		}
+
+		print("\n");
+
+		for (size_t lines = 3 + random(20); lines > 0; lines--)
+			print("{}.\n", sentence(5 + random(10)));
+
+		print("\n");
+	};
+
+	// Replies go to a random bug that has already been reported, with a preference for recent ones.
+	for (size_t bug = 0; bug < bugs; bug++) {
+		message(bug, false);
+		for (size_t n = replies; n > 0; n--) {
+			size_t age = random(bug + 1);
+			message(bug - (chance(50) ? age / 16 : age), true);
+		}
+	}
+
+	return 0;
+}
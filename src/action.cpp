@@ -19,7 +19,7 @@ using namespace std;
 using namespace fmt;
 
 static int do_action(const string &id, const string &action) {
-	LightBTS::Instance bts(data_dir);
+	auto &bts = open_instance();
 
 	auto ticket = bts.get_ticket(id);
 	auto first_message_id = bts.get_first_message_id(ticket);
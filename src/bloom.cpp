@@ -0,0 +1,55 @@
+/* LightBTS -- a lightweight issue tracking system
+   Copyright © 2018 Guus Sliepen <guus@lightbts.info>
+
+   SPDX-License-Identifier: GPL-3.0+
+*/
+
+#include <algorithm>
+#include <functional>
+
+#include "bloom.hpp"
+
+using namespace std;
+
+// Derive a second, independent hash from the first one, the finalizer of SplitMix64.
+static uint64_t mix(uint64_t h) {
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111eb;
+	h ^= h >> 31;
+	return h;
+}
+
+namespace LightBTS {
+
+BloomFilter::BloomFilter(size_t expected): bits(max<size_t>(expected * bits_per_key / 64 + 1, 16)) {
+}
+
+// The bits for a key are h1 + i * h2, as described by Kirsch and Mitzenmacher.
+void BloomFilter::add(std::string_view key) {
+	uint64_t h1 = hash<std::string_view>{}(key);
+	uint64_t h2 = mix(h1) | 1;
+	uint64_t size = bits.size() * 64;
+
+	for (unsigned int i = 0; i < hashes; i++) {
+		auto bit = (h1 + i * h2) % size;
+		bits[bit / 64] |= uint64_t(1) << (bit % 64);
+	}
+}
+
+bool BloomFilter::maybe_contains(std::string_view key) const {
+	uint64_t h1 = hash<std::string_view>{}(key);
+	uint64_t h2 = mix(h1) | 1;
+	uint64_t size = bits.size() * 64;
+
+	for (unsigned int i = 0; i < hashes; i++) {
+		auto bit = (h1 + i * h2) % size;
+		if (!(bits[bit / 64] & (uint64_t(1) << (bit % 64))))
+			return false;
+	}
+
+	return true;
+}
+
+}
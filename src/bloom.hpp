@@ -0,0 +1,32 @@
+#pragma once
+
+/* LightBTS -- a lightweight issue tracking system
+   Copyright © 2018 Guus Sliepen <guus@lightbts.info>
+
+   SPDX-License-Identifier: GPL-3.0+
+*/
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+namespace LightBTS {
+
+/* A Bloom filter, a compact set of strings that can only answer whether a string is definitely not in it.
+ * When sized for the number of strings added, about 1% of the other strings are false positives.
+ * Lookups may be done from multiple threads, as long as nothing is being added.
+ */
+class BloomFilter {
+	std::vector<uint64_t> bits;
+
+	static const unsigned int hashes = 7;
+	static const size_t bits_per_key = 10;
+
+	public:
+	BloomFilter(size_t expected = 0);
+
+	void add(std::string_view key);
+	bool maybe_contains(std::string_view key) const;
+};
+
+}
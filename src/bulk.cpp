@@ -0,0 +1,326 @@
+/* LightBTS -- a lightweight issue tracking system
+   Copyright © 2018 Guus Sliepen <guus@lightbts.info>
+
+   SPDX-License-Identifier: GPL-3.0+
+*/
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <fmt/ostream.h>
+
+#include "bulk.hpp"
+#include "profile.hpp"
+
+using namespace std;
+using namespace fmt;
+
+namespace LightBTS {
+
+static const size_t min_known_capacity = 1024;
+
+BulkImport::BulkImport(Instance &bts, size_t batch_size): bts(bts), batch_size(batch_size ? batch_size : 1) {
+	start = chrono::steady_clock::now();
+
+	known_capacity = max<size_t>(bts.db.execute("SELECT count(*) FROM messages").get_int64(0), min_known_capacity);
+	known.emplace_back(known_capacity);
+	for (auto &&row: bts.db.execute("SELECT msgid FROM messages"))
+		add_known(row.get_string(0));
+}
+
+// Must be called with known_lock held.
+bool BulkImport::maybe_known(const string &msgid) const {
+	for (auto &&filter: known)
+		if (filter.maybe_contains(msgid))
+			return true;
+	return false;
+}
+
+// Must be called with known_lock held.
+void BulkImport::add_known(const string &msgid) {
+	// Keep the false positive rate low by starting a new, larger filter when the last one is full.
+	if (known_count >= known_capacity) {
+		known_capacity *= 2;
+		known.emplace_back(known_capacity);
+		known_count = 0;
+	}
+
+	known.back().add(msgid);
+	known_count++;
+}
+
+/* Returns true if the Message-ID is definitely new, in which case the caller must store the message.
+ * Concurrent copies of the same message can only be claimed once.
+ */
+bool BulkImport::claim(const string &msgid) {
+	lock_guard<mutex> guard(known_lock);
+	if (maybe_known(msgid))
+		return false;
+	add_known(msgid);
+	unindexed.insert(msgid);
+	return true;
+}
+
+// A claimed message could not be stored after all.
+void BulkImport::unclaim(const string &msgid) {
+	lock_guard<mutex> guard(known_lock);
+	unindexed.erase(msgid);
+}
+
+// Store the message if it is new, otherwise return an empty hash.
+string BulkImport::store(const Message &msg) {
+	auto msgid = Instance::get_msgid(msg);
+	if (!claim(msgid))
+		return {};
+
+	try {
+		return bts.store(msg);
+	} catch (...) {
+		unclaim(msgid);
+		throw;
+	}
+}
+
+void BulkImport::add(const Message &in) {
+	Message msg = bts.prepare(in);
+	string hash = store(msg);
+	add_stored(move(msg), move(hash));
+}
+
+/* Messages without a hash have not been stored yet, because they might be duplicates,
+ * either of an indexed message or of one stored by this import that is not indexed yet.
+ */
+void BulkImport::add_stored(Message &&msg, string &&hash) {
+	stats.messages++;
+
+	if (hash.empty()) {
+		auto msgid = Instance::get_msgid(msg);
+		bool pending;
+		{
+			lock_guard<mutex> guard(known_lock);
+			pending = unindexed.count(msgid);
+		}
+
+		if (pending || bts.is_duplicate(msg)) {
+			stats.duplicates++;
+			return;
+		}
+
+		hash = bts.store(msg);
+
+		lock_guard<mutex> guard(known_lock);
+		unindexed.insert(msgid);
+	}
+
+	batch.push_back(move(msg));
+	hashes.push_back(move(hash));
+
+	if (batch.size() >= batch_size)
+		flush();
+}
+
+size_t BulkImport::add_files(const vector<string> &filenames, unsigned int jobs) {
+	return add_parallel(filenames.size(), jobs, [&](size_t i, Message &msg, string &hash) {
+		auto &&filename = filenames[i];
+		ifstream file(filename);
+		if (!file.is_open())
+			throw runtime_error(format("Could not open {}: {}", filename, strerror(errno)));
+
+		try {
+			Message in;
+			in.load(file);
+			msg = bts.prepare(in);
+			hash = store(msg);
+		} catch (runtime_error &e) {
+			throw runtime_error(format("Error parsing {}: {}", filename, e.what()));
+		}
+	});
+}
+
+size_t BulkImport::add_from_store(const vector<string> &hashes, unsigned int jobs) {
+	return add_parallel(hashes.size(), jobs, [&](size_t i, Message &msg, string &hash) {
+		try {
+			istringstream data(bts.messages->load(hashes[i]));
+			msg.load(data);
+			hash = hashes[i];
+		} catch (runtime_error &e) {
+			throw runtime_error(format("Error parsing stored message {}: {}", hashes[i], e.what()));
+		}
+	});
+}
+
+size_t BulkImport::add_parallel(size_t count, unsigned int jobs, const function<void(size_t i, Message &msg, string &hash)> &load) {
+	struct slot {
+		bool done = false;
+		Message msg;
+		string hash;
+		string error;
+	};
+
+	if (!jobs)
+		jobs = max(1u, thread::hardware_concurrency());
+
+	// Limit the number of parsed messages waiting to be indexed.
+	const size_t window = jobs * 16;
+	vector<slot> slots(window);
+	mutex lock;
+	condition_variable produced;
+	condition_variable consumed;
+	size_t next_job = 0;
+	size_t next_write = 0;
+	bool stop = false;
+
+	auto worker = [&]() {
+		while (true) {
+			unique_lock<mutex> guard(lock);
+			consumed.wait(guard, [&]{ return stop || next_job >= count || next_job < next_write + window; });
+			if (stop || next_job >= count)
+				return;
+			size_t i = next_job++;
+			guard.unlock();
+
+			slot result;
+			try {
+				load(i, result.msg, result.hash);
+			} catch (runtime_error &e) {
+				result.error = e.what();
+			}
+
+			guard.lock();
+			slots[i % window] = move(result);
+			slots[i % window].done = true;
+			produced.notify_all();
+		}
+	};
+
+	vector<thread> workers;
+	for (unsigned int i = 0; i < min<size_t>(jobs, count); i++)
+		workers.emplace_back(worker);
+
+	auto join = [&]() {
+		{
+			lock_guard<mutex> guard(lock);
+			stop = true;
+		}
+		consumed.notify_all();
+		for (auto &&thread: workers)
+			thread.join();
+	};
+
+	size_t errors = 0;
+
+	try {
+		for (size_t i = 0; i < count; i++) {
+			unique_lock<mutex> guard(lock);
+			auto &next = slots[i % window];
+			produced.wait(guard, [&]{ return next.done; });
+			slot result = move(next);
+			next.done = false;
+			next_write++;
+			guard.unlock();
+			consumed.notify_all();
+
+			if (!result.error.empty()) {
+				print(cerr, "{}\n", result.error);
+				errors++;
+				continue;
+			}
+
+			add_stored(move(result.msg), move(result.hash));
+		}
+	} catch (...) {
+		join();
+		throw;
+	}
+
+	join();
+
+	return errors;
+}
+
+void BulkImport::flush() {
+	if (batch.empty())
+		return;
+
+	Profile::Timer timer("bulk.flush");
+
+	stats.batches++;
+
+	vector<pair<string, string>> hook_batch;
+	for (auto &&hash: hashes)
+		hook_batch.emplace_back(hash, "");
+
+	// Later copies of these messages are checked against the index again.
+	auto forget = [&]() {
+		lock_guard<mutex> guard(known_lock);
+		for (auto &&msg: batch)
+			unindexed.erase(Instance::get_msgid(msg));
+	};
+
+	if (hooks && !bts.run_batch_hook("pre-index", hook_batch)) {
+		stats.rejected += batch.size();
+		forget();
+		batch.clear();
+		hashes.clear();
+		return;
+	}
+
+	hook_batch.clear();
+
+	auto tx = bts.db.begin();
+
+	for (size_t i = 0; i < batch.size(); i++) {
+		// Use a savepoint so a bad message does not abort the whole batch.
+		bts.db.execute("SAVEPOINT message");
+
+		try {
+			// A compaction that ran since the message was stored did not find it in the index, and dropped it.
+			if (!bts.messages->exists(hashes[i]))
+				bts.store(batch[i]);
+
+			bool is_new;
+			string id = bts.index(batch[i], is_new);
+			if (!id.empty() && hooks && bts.queue_hooks)
+				bts.queue_hook("post-index", Instance::get_msgid(batch[i]), id);
+			bts.db.execute("RELEASE message");
+
+			if (id.empty()) {
+				stats.duplicates++;
+				continue;
+			}
+
+			stats.imported++;
+			if (is_new)
+				stats.new_bugs++;
+			if (!bts.queue_hooks)
+				hook_batch.emplace_back(hashes[i], id);
+		} catch (runtime_error &e) {
+			bts.db.execute("ROLLBACK TO message");
+			bts.db.execute("RELEASE message");
+			print(cerr, "Error importing message with Message-ID {}: {}\n", batch[i]["Message-ID"], e.what());
+			stats.failed++;
+		}
+	}
+
+	if (!tx.commit())
+		throw runtime_error("Failed to commit transaction");
+
+	forget();
+	batch.clear();
+	hashes.clear();
+
+	if (hooks && !hook_batch.empty())
+		bts.run_batch_hook("post-index", hook_batch);
+}
+
+const BulkImport::statistics &BulkImport::get_statistics() {
+	stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	return stats;
+}
+
+}
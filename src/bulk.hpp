@@ -0,0 +1,87 @@
+#pragma once
+
+/* LightBTS -- a lightweight issue tracking system
+   Copyright © 2018 Guus Sliepen <guus@lightbts.info>
+
+   SPDX-License-Identifier: GPL-3.0+
+*/
+
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "bloom.hpp"
+#include "lightbts.hpp"
+
+namespace LightBTS {
+
+/* Imports a large number of messages efficiently.
+ * Messages are stored as soon as they are added,
+ * but they are indexed in batches, each batch in a single transaction.
+ * Hooks are run once per batch instead of once per message,
+ * with BATCH_FILE pointing to a list of message files.
+ *
+ * When adding files, parsing and storing messages is done by a pool of worker threads,
+ * while indexing is done by the calling thread in the original order of the files,
+ * so replies are always indexed after the messages they refer to.
+ * Messages that are already in the store, for example when rebuilding the index,
+ * are loaded and parsed the same way.
+ *
+ * Messages whose Message-ID might already be indexed or stored by this import, according to a Bloom filter,
+ * are not stored by the workers, but checked against the index and the messages that are not indexed yet
+ * by the calling thread, so duplicates cause no writes and are not passed to hooks.
+ * The Message-IDs stored by this import are added to the filter,
+ * which grows by adding larger filters when it is full.
+ */
+class BulkImport {
+	Instance &bts;
+	size_t batch_size;
+	bool hooks = true;
+
+	std::mutex known_lock;
+	vector<BloomFilter> known;
+	size_t known_capacity = 0;  // of the last filter
+	size_t known_count = 0;
+	std::set<string> unindexed;  // Message-IDs stored by this import that have not been indexed yet
+
+	vector<Message> batch;
+	vector<string> hashes;
+
+	std::chrono::steady_clock::time_point start;
+
+	bool maybe_known(const string &msgid) const;
+	void add_known(const string &msgid);
+	bool claim(const string &msgid);
+	void unclaim(const string &msgid);
+	string store(const Message &msg);
+	void add_stored(Message &&msg, string &&hash);
+	size_t add_parallel(size_t count, unsigned int jobs, const std::function<void(size_t i, Message &msg, string &hash)> &load);
+
+	public:
+	struct statistics {
+		size_t messages = 0;
+		size_t imported = 0;
+		size_t new_bugs = 0;
+		size_t duplicates = 0;
+		size_t rejected = 0;
+		size_t failed = 0;
+		size_t batches = 0;
+		double seconds = 0;
+	} stats;
+
+	static const size_t default_batch_size = 1000;
+
+	BulkImport(Instance &bts, size_t batch_size = default_batch_size);
+
+	void add(const Message &msg);
+	size_t add_files(const vector<string> &filenames, unsigned int jobs = 0);
+	size_t add_from_store(const vector<string> &hashes, unsigned int jobs = 0);
+	void set_hooks(bool value) { hooks = value; }
+	void flush();
+	const statistics &get_statistics();
+};
+
+}
@@ -8,6 +8,7 @@
 #include "lightbts.hpp"
 
 #include <algorithm>
+#include <fstream>
 #include <iostream>
 #include <getopt.h>
 #include <vector>
@@ -16,12 +17,20 @@
 #include <fmt/ostream.h>
 
 #include "action.hpp"
+#include "compact.hpp"
 #include "config.hpp"
 #include "create.hpp"
+#include "fsck.hpp"
+#include "hooks.hpp"
 #include "import.hpp"
 #include "list.hpp"
+#include "profile.hpp"
+#include "reindex.hpp"
 #include "reply.hpp"
+#include "serve.hpp"
+#include "search.hpp"
 #include "show.hpp"
+#include "web.hpp"
 
 using namespace std;
 using namespace fmt;
@@ -37,6 +46,15 @@ bool verbose;
 bool no_hooks;
 bool no_email;
 bool batch;
+bool bulk;
+bool repair;
+bool threaded;
+unsigned int jobs;
+uint64_t offset;
+size_t limit;
+string after;
+string order;
+string profile;
 
 string severity;
 string data_dir;
@@ -46,6 +64,53 @@ vector<string> tags;
 vector<string> versions;
 vector<string> attachments;
 
+bool serving;
+static unique_ptr<LightBTS::Instance> instance;
+
+/* The instance commands operate on.
+ * It is only opened once, and stays open between requests when running as a server.
+ */
+LightBTS::Instance &open_instance() {
+	if (instance && instance->is_stale())
+		instance.reset();
+	if (!instance)
+		instance = make_unique<LightBTS::Instance>(data_dir);
+
+	// Options that change what the instance does must be set again for every request.
+	instance->set_no_hooks(no_hooks);
+	return *instance;
+}
+
+void close_instance() {
+	instance.reset();
+}
+
+// Restore the defaults of all options, so the command line can be parsed again.
+static void reset_options() {
+	help = false;
+	verbose = false;
+	no_hooks = false;
+	no_email = false;
+	batch = false;
+	bulk = false;
+	repair = false;
+	threaded = false;
+	jobs = 0;
+	offset = 0;
+	limit = 0;
+	after.clear();
+	order.clear();
+	profile.clear();
+	severity.clear();
+	data_dir.clear();
+	cl_message.clear();
+	tags.clear();
+	versions.clear();
+	attachments.clear();
+	LightBTS::Profile::enabled = false;
+	LightBTS::Profile::reset();
+}
+
 static void show_version() {
 	print(
 			"LightBTS version {}\n"
@@ -91,7 +156,7 @@ static int do_config(const char *argv0, const vector<string> &args) {
 	auto section = args[0].substr(0, dot);
 	auto variable = args[0].substr(dot + 1);
 
-	LightBTS::Instance bts(data_dir);
+	auto &bts = open_instance();
 
 	if (args.size() > 1) {
 		auto value = args[1];
@@ -115,16 +180,27 @@ static const struct option long_options[] = {
 	{"batch", no_argument, nullptr, 2},
 	{"no-email", no_argument, nullptr, 3},
 	{"no-hooks", no_argument, nullptr, 4},
+	{"bulk", no_argument, nullptr, 5},
+	{"jobs", required_argument, nullptr, 'j'},
+	{"offset", required_argument, nullptr, 6},
+	{"limit", required_argument, nullptr, 7},
+	{"after", required_argument, nullptr, 8},
+	{"sort", required_argument, nullptr, 9},
+	{"repair", no_argument, nullptr, 10},
+	{"profile", optional_argument, nullptr, 11},
+	{"thread", no_argument, nullptr, 12},
 	{"data-dir", required_argument, nullptr, 'd'},
 	{"version", no_argument, nullptr, 'V'},
 	{"tag", no_argument, nullptr, 'T'},
 	{"severity", no_argument, nullptr, 'S'},
 	{"attach", no_argument, nullptr, 'A'},
+	{nullptr, 0, nullptr, 0},
 };
 
 struct cli_function {
 	const char *name;
 	int (*function)(const char *, const vector<string> &);
+	bool served;  // whether lbts serve can run this command
 	friend bool operator<(const struct cli_function &a, const char *b) {
 		return strcmp(a.name, b) < 0;
 	}
@@ -139,6 +215,16 @@ static void show_help(ostream &out, const char *argv0) {
 			"  --batch         No interactive input.\n"
 			"  --no-email      Do not send email messages.\n"
 			"  --no-hooks      Do not call hooks.\n"
+			"  --bulk          Import messages in large batches.\n"
+			"  -j, --jobs=N    Number of threads to use for bulk imports, reindexing and queued hooks.\n"
+			"  --offset=N      Start importing an mbox at byte offset N.\n"
+			"  --limit=N       List at most N bugs.\n"
+			"  --after=TOKEN   Continue a list after the given token.\n"
+			"  --sort=ORDER    Sort the list by id or severity.\n"
+			"  --repair        Repair problems found by fsck.\n"
+			"  --thread        Show the messages of a bug as a reply tree.\n"
+			"  --profile[=FILE]\n"
+			"                  Report where the time was spent, to stderr or as JSON to FILE.\n"
 			"  --data-dir=DIR  Directory where LightBTS stores its data.\n"
 			"\n"
 			"Commands:\n"
@@ -172,6 +258,11 @@ static void show_help(ostream &out, const char *argv0) {
 			"  deadline    Change the deadline of a ticket.\n"
 			"  index       Update the index for a given message file.\n"
 			"  fsck        Perform an integrity check.\n"
+			"  compact     Compact the message store.\n"
+			"  reindex     Rebuild the index from the message store.\n"
+			"  serve       Keep the instance open and run commands for other lbts processes.\n"
+			"  hooks run   Run queued hooks.\n"
+			"  web         Serve the web interface.\n"
 			, argv0);
 }
 
@@ -196,37 +287,50 @@ static int do_help(const char *argv0, const vector<string> &args) {
 
 // Keep the following list sorted at all times.
 static const cli_function functions[] = {
-	{"close", do_close},
-	{"config", do_config},
-	{"create", do_create},
-	{"deadline", do_deadline},
-	{"fixed", do_fixed},
-	{"found", do_found},
-	{"help", do_help},
-	{"import", do_import},
-	{"init", do_init},
-	{"link", do_link},
-	{"list", do_list},
-	{"milestone", do_milestone},
-	{"noowner", do_noowner},
-	{"notfixed", do_notfixed},
-	{"notfound", do_notfound},
-	{"owner", do_owner},
-	{"progress", do_progress},
-	{"reopen", do_reopen},
-	{"reply", do_reply},
-	{"retitle", do_retitle},
-	{"severity", do_severity},
-	{"show", do_show},
-	{"subject", do_retitle},
-	{"tag", do_tags},
-	{"tags", do_tags},
-	{"title", do_retitle},
-	{"unlink", do_unlink},
-	{"version", do_version},
+	{"close", do_close, true},
+	{"compact", do_compact, false},
+	{"config", do_config, true},
+	{"create", do_create, true},
+	{"deadline", do_deadline, true},
+	{"fixed", do_fixed, true},
+	{"found", do_found, true},
+	{"fsck", do_fsck, false},
+	{"help", do_help, false},
+	{"hooks", do_hooks, false},
+	{"import", do_import, true},
+	{"init", do_init, false},
+	{"link", do_link, true},
+	{"list", do_list, true},
+	{"milestone", do_milestone, true},
+	{"noowner", do_noowner, true},
+	{"notfixed", do_notfixed, true},
+	{"notfound", do_notfound, true},
+	{"owner", do_owner, true},
+	{"progress", do_progress, true},
+	{"reindex", do_reindex, false},
+	{"reopen", do_reopen, true},
+	{"reply", do_reply, true},
+	{"retitle", do_retitle, true},
+	{"search", do_search, true},
+	{"serve", do_serve, false},
+	{"severity", do_severity, true},
+	{"show", do_show, true},
+	{"subject", do_retitle, true},
+	{"tag", do_tags, true},
+	{"tags", do_tags, true},
+	{"title", do_retitle, true},
+	{"unlink", do_unlink, true},
+	{"version", do_version, false},
+	{"web", do_web, false},
 };
 
-int main(int argc, char *argv[]) {
+/* Parse the command line and run the command.
+ * When serving, this is called for every request, with the file descriptors and environment of the client.
+ */
+int run_command_line(int argc, char *argv[]) {
+	reset_options();
+	optind = 0;
+
 	if (argc <= 1) {
 		show_help(cerr, argv[0]);
 		return 1;
@@ -240,8 +344,13 @@ int main(int argc, char *argv[]) {
 	string command;
 	vector<string> args;
 
+	if (getenv("LIGHTBTS_PROFILE")) {
+		LightBTS::Profile::enabled = true;
+		profile = getenv("LIGHTBTS_PROFILE");
+	}
+
 	int r;
-	while((r = getopt_long(argc, argv, "-hvd:m:V:T:S:A:", long_options, nullptr)) != EOF) {
+	while((r = getopt_long(argc, argv, "-hvd:j:m:V:T:S:A:", long_options, nullptr)) != EOF) {
 		switch (r) {
 		case 'h':
 			help = true;
@@ -263,10 +372,47 @@ int main(int argc, char *argv[]) {
 			no_hooks = true;
 			break;
 
+		case 5:
+			bulk = true;
+			break;
+
+		case 6:
+			offset = strtoull(optarg, nullptr, 10);
+			break;
+
+		case 7:
+			limit = strtoull(optarg, nullptr, 10);
+			break;
+
+		case 8:
+			after = optarg;
+			break;
+
+		case 9:
+			order = optarg;
+			break;
+
+		case 10:
+			repair = true;
+			break;
+
+		case 11:
+			LightBTS::Profile::enabled = true;
+			profile = optarg ? optarg : "";
+			break;
+
+		case 12:
+			threaded = true;
+			break;
+
 		case 'd':
 			data_dir = optarg;
 			break;
 
+		case 'j':
+			jobs = atoi(optarg);
+			break;
+
 		case 'm':
 			cl_message = optarg;
 			batch = true;
@@ -322,9 +468,47 @@ int main(int argc, char *argv[]) {
 
 	auto match = lower_bound(begin(functions), end(functions), command.c_str());
 	if (match != end(functions) && command == match->name) {
-		return match->function(argv[0], args);
+		int result;
+
+		if (match->served && !serving && forward_to_server(argc, argv, result))
+			return result;
+
+		if (!LightBTS::Profile::enabled) {
+			result = match->function(argv[0], args);
+			if (!serving)
+				close_instance();
+			return result;
+		}
+
+		// An instance cached by the server has already run statements for earlier requests.
+		if (instance)
+			instance->skip_profiled_statements();
+
+		{
+			LightBTS::Profile::Timer timer("total");
+			result = match->function(argv[0], args);
+			if (instance)
+				instance->profile_statements();
+			if (!serving)
+				close_instance();
+		}
+
+		if (profile.empty() || profile == "-") {
+			LightBTS::Profile::report(cerr);
+		} else {
+			ofstream out(profile);
+			LightBTS::Profile::report_json(out);
+			if (!out.good())
+				print(cerr, "Could not write profile to {}\n", profile);
+		}
+
+		return result;
 	} else {
 		print(cerr, "{0}: unrecognized command '{1}'\nTry '{0} --help' for more information.\n", argv[0], command);
 		return 1;
 	}
 }
+
+int main(int argc, char *argv[]) {
+	return run_command_line(argc, argv);
+}
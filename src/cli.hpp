@@ -8,6 +8,7 @@
 
 #include <unistd.h>
 
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -15,13 +16,30 @@ extern bool verbose;
 extern bool no_hooks;
 extern bool no_email;
 extern bool batch;
+extern bool bulk;
+extern bool repair;
+extern bool threaded;
+extern unsigned int jobs;
+extern uint64_t offset;
+extern size_t limit;
 
 extern const std::string lightbts_version;
 
 extern std::string severity;
 extern std::string data_dir;
 extern std::string cl_message;
+extern std::string after;
+extern std::string order;
 
 extern std::vector<std::string> tags;
 extern std::vector<std::string> versions;
 extern std::vector<std::string> attachments;
+
+namespace LightBTS {
+class Instance;
+}
+
+extern bool serving;
+extern LightBTS::Instance &open_instance();
+extern void close_instance();
+extern int run_command_line(int argc, char *argv[]);
@@ -0,0 +1,35 @@
+/* LightBTS -- a lightweight issue tracking system
+   Copyright © 2018 Guus Sliepen <guus@lightbts.info>
+
+   SPDX-License-Identifier: GPL-3.0+
+*/
+
+#include <fmt/ostream.h>
+#include <iostream>
+
+#include "compact.hpp"
+
+#include "cli.hpp"
+#include "lightbts.hpp"
+
+using namespace std;
+using namespace fmt;
+
+int do_compact(const char *argv0, const vector<string> &args) {
+	if (!args.empty()) {
+		print(cerr, "Too many arguments\n");
+		return 1;
+	}
+
+	LightBTS::Instance bts(data_dir);
+
+	auto stats = bts.compact();
+
+	if (verbose) {
+		print(cerr, "Kept {} messages, {} of which were loose files\n", stats.kept, stats.loose);
+		print(cerr, "Dropped {} unreferenced or superseded messages\n", stats.dropped);
+		print(cerr, "Message store size went from {} to {} bytes\n", stats.bytes_before, stats.bytes_after);
+	}
+
+	return 0;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+/* LightBTS -- a lightweight issue tracking system
+   Copyright © 2018 Guus Sliepen <guus@lightbts.info>
+
+   SPDX-License-Identifier: GPL-3.0+
+*/
+
+#include <string>
+#include <vector>
+
+extern int do_compact(const char *argv0, const std::vector<std::string> &args);
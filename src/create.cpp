@@ -23,7 +23,7 @@ int do_create(const char *argv0, const vector<string> &args) {
 		return 1;
 	}
 
-	LightBTS::Instance bts(data_dir);
+	auto &bts = open_instance();
 
 	LightBTS::Message msg;
 	msg.set_crlf(false);
@@ -0,0 +1,53 @@
+/* LightBTS -- a lightweight issue tracking system
+   Copyright © 2018 Guus Sliepen <guus@lightbts.info>
+
+   SPDX-License-Identifier: GPL-3.0+
+*/
+
+#include <fmt/ostream.h>
+#include <iostream>
+#include <unistd.h>
+
+#include "fsck.hpp"
+
+#include "cli.hpp"
+#include "lightbts.hpp"
+
+using namespace std;
+using namespace fmt;
+
+int do_fsck(const char *argv0, const vector<string> &args) {
+	if (!args.empty()) {
+		print(cerr, "Too many arguments\n");
+		return 1;
+	}
+
+	LightBTS::Instance bts(data_dir);
+
+	// Only show progress on a terminal, and stay on the same line.
+	bool show_progress = isatty(2);
+
+	auto progress = [&](size_t done, size_t total) {
+		if (show_progress)
+			print(cerr, "\rChecking messages: {}/{}", done, total);
+	};
+
+	auto stats = bts.fsck(repair, jobs, progress);
+
+	if (show_progress)
+		print(cerr, "\n");
+
+	if (verbose || stats.problems()) {
+		print(cerr, "{} indexed and {} stored messages\n", stats.indexed, stats.stored);
+		print(cerr, "{} missing, {} not indexed, {} corrupt, {} dangling index entries, {} index errors\n",
+		      stats.missing, stats.orphans, stats.corrupt, stats.dangling, stats.index_errors);
+	}
+
+	if (repair && stats.repaired)
+		print(cerr, "Repaired {} problems\n", stats.repaired);
+
+	if (stats.problems() > stats.repaired)
+		return 1;
+
+	return 0;
+}
@@ -4,33 +4,277 @@
    SPDX-License-Identifier: GPL-3.0+
 */
 
+/* Generates two files from the built-in templates:
+ * an include file with the text of every template, which is installed in new instances,
+ * and a header with every template compiled to a C++ struct with a render function.
+ *
+ * The struct has a std::string_view member for every value the template uses,
+ * and a std::vector of a nested struct for every section.
+ * Names used inside a section are members of the nested struct,
+ * like in Mustache, where they are looked up in the element first.
+ * Rendering writes the literal text as references to string literals,
+ * and only copies the values.
+ */
+
+#include <algorithm>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
 #include <boost/filesystem.hpp>
 
+#include "mustache.hpp"
+
 using namespace std;
+using namespace LightBTS::Mustache;
 namespace fs = boost::filesystem;
 
+static const set<string> keywords = {
+	"alignas", "alignof", "and", "asm", "auto", "bool", "break", "case", "catch", "char", "class", "const",
+	"constexpr", "continue", "default", "delete", "do", "double", "else", "enum", "explicit", "export",
+	"extern", "false", "float", "for", "friend", "goto", "if", "inline", "int", "long", "mutable",
+	"namespace", "new", "noexcept", "not", "nullptr", "operator", "or", "private", "protected", "public",
+	"register", "return", "short", "signed", "sizeof", "static", "struct", "switch", "template", "this",
+	"throw", "true", "try", "typedef", "typeid", "typename", "union", "unsigned", "using", "virtual",
+	"void", "volatile", "while", "xor", "render",
+};
+
+// Turn a name into a valid C++ identifier.
+static string identifier(const string &name) {
+	string result;
+
+	for (auto c: name)
+		result += isalnum((unsigned char)c) ? c : '_';
+
+	if (result.empty() || isdigit((unsigned char)result[0]) || keywords.count(result))
+		result += '_';
+
+	return result;
+}
+
+// One level of a template: the template itself, or a section.
+struct level {
+	string name;
+	level *parent = nullptr;
+	vector<string> values;
+	vector<unique_ptr<level>> sections;
+	vector<string> inverted;
+
+	bool has_value(const string &n) const {
+		return find(values.begin(), values.end(), n) != values.end();
+	}
+
+	level *find_section(const string &n) const {
+		for (auto &&s: sections)
+			if (s->name == n)
+				return s.get();
+		return nullptr;
+	}
+};
+
+static void collect(level &lvl, const vector<Token> &tokens, size_t begin, size_t end) {
+	for (size_t i = begin; i < end; i++) {
+		auto &&tok = tokens[i];
+		string name(tok.text);
+
+		switch (tok.type) {
+		case Token::Type::VALUE:
+		case Token::Type::RAW_VALUE:
+			if (!lvl.has_value(name))
+				lvl.values.push_back(name);
+			break;
+
+		case Token::Type::SECTION: {
+			auto section = lvl.find_section(name);
+			if (!section) {
+				lvl.sections.push_back(make_unique<level>());
+				section = lvl.sections.back().get();
+				section->name = name;
+				section->parent = &lvl;
+			}
+			collect(*section, tokens, i + 1, tok.end);
+			i = tok.end;
+			break;
+		}
+
+		case Token::Type::INVERTED:
+			lvl.inverted.push_back(name);
+			collect(lvl, tokens, i + 1, tok.end);
+			i = tok.end;
+			break;
+
+		default:
+			break;
+		}
+	}
+}
+
+/* Inverted sections test a section or value of the same level or an enclosing one,
+ * names only used in inverted sections become values.
+ */
+static void resolve(level &lvl) {
+	for (auto &&name: lvl.inverted) {
+		bool found = false;
+		for (auto l = &lvl; l && !found; l = l->parent)
+			found = l->has_value(name) || l->find_section(name);
+		if (!found)
+			lvl.values.push_back(name);
+	}
+
+	for (auto &&name: lvl.values)
+		if (lvl.find_section(name))
+			throw runtime_error("Name " + name + " is used both as a value and as a section");
+
+	for (auto &&section: lvl.sections)
+		resolve(*section);
+}
+
+static void declare(ostream &out, const level &lvl, const string &indent) {
+	for (auto &&section: lvl.sections) {
+		out << indent << "struct " << identifier(section->name) << "_item {\n";
+		declare(out, *section, indent + "\t");
+		out << indent << "};\n";
+	}
+
+	for (auto &&name: lvl.values)
+		out << indent << "std::string_view " << identifier(name) << ";\n";
+
+	for (auto &&section: lvl.sections)
+		out << indent << "std::vector<" << identifier(section->name) << "_item> " << identifier(section->name) << ";\n";
+}
+
+// The variables that refer to each level while rendering.
+struct scope {
+	const level *lvl;
+	string var;
+	const scope *parent;
+};
+
+static string lookup(const scope *s, const string &name) {
+	for (; s; s = s->parent)
+		if (s->lvl->has_value(name) || s->lvl->find_section(name))
+			return s->var + identifier(name);
+	throw runtime_error("Cannot resolve " + name);
+}
+
+static void emit(ostream &out, const vector<Token> &tokens, size_t begin, size_t end, const scope &s, const string &indent, int &counter) {
+	for (size_t i = begin; i < end; i++) {
+		auto &&tok = tokens[i];
+		string name(tok.text);
+
+		switch (tok.type) {
+		case Token::Type::TEXT:
+			if (tok.text.find(")__TEMPLATE__") != tok.text.npos)
+				throw runtime_error("Template contains the raw string delimiter");
+			out << indent << "out.text({R\"__TEMPLATE__(" << tok.text << ")__TEMPLATE__\", " << tok.text.size() << "});\n";
+			break;
+
+		case Token::Type::VALUE:
+			out << indent << "out.escape(" << lookup(&s, name) << ");\n";
+			break;
+
+		case Token::Type::RAW_VALUE:
+			out << indent << "out.copy(" << lookup(&s, name) << ");\n";
+			break;
+
+		case Token::Type::SECTION: {
+			auto item = "item" + to_string(++counter);
+			out << indent << "for (auto &&" << item << ": " << lookup(&s, name) << ") {\n";
+			scope inner{s.lvl->find_section(name), item + ".", &s};
+			emit(out, tokens, i + 1, tok.end, inner, indent + "\t", counter);
+			out << indent << "}\n";
+			i = tok.end;
+			break;
+		}
+
+		case Token::Type::INVERTED:
+			out << indent << "if (" << lookup(&s, name) << ".empty()) {\n";
+			emit(out, tokens, i + 1, tok.end, s, indent + "\t", counter);
+			out << indent << "}\n";
+			i = tok.end;
+			break;
+
+		case Token::Type::END:
+			break;
+		}
+	}
+}
+
+static void compile(ostream &out, const string &filename, const string &data) {
+	auto tokens = tokenize(data);
+
+	level root;
+	collect(root, tokens, 0, tokens.size());
+	resolve(root);
+
+	auto type = identifier(filename);
+
+	out << "// " << filename << "\n";
+	out << "struct " << type << " {\n";
+	declare(out, root, "\t");
+	out << "\n\tvoid render(Writer &out) const;\n";
+	out << "};\n\n";
+
+	out << "inline void " << type << "::render(Writer &out) const {\n";
+	scope s{&root, "this->", nullptr};
+	int counter = 0;
+	emit(out, tokens, 0, tokens.size(), s, "\t", counter);
+	out << "}\n\n";
+}
+
 int main(int argc, char *argv[]) {
-	if (argc < 2) {
-		cerr << "Usage: {} input...\n";
+	if (argc < 4) {
+		cerr << "Usage: " << argv[0] << " templates.inl templates.hpp input...\n";
 		return 1;
 	}
 
-	ostream &out = cout;
+	ofstream inl(argv[1]);
+	ofstream hpp(argv[2]);
 
-	out << "// This is an automatically generated file, DO NOT EDIT!\n\n"
+	inl << "// This is an automatically generated file, DO NOT EDIT!\n\n"
 			"static struct {\n"
 			"\tconst char *filename;\n"
 			"\tconst char *data;\n"
 			"} templates[] = {\n";
 
-	for (int i = 1; i < argc; i++) {
-		out << "\t{\"" << fs::path(argv[i]).filename().string() << "\", R\"__TEMPLATE__(";
+	hpp << "// This is an automatically generated file, DO NOT EDIT!\n\n"
+			"#pragma once\n\n"
+			"#include <string_view>\n"
+			"#include <vector>\n\n"
+			"#include \"writer.hpp\"\n\n"
+			"namespace LightBTS {\n\n"
+			"namespace Templates {\n\n";
+
+	for (int i = 3; i < argc; i++) {
 		ifstream in(argv[i]);
-		out << in.rdbuf();
-		out << ")__TEMPLATE__\"},\n";
+		if (!in.is_open()) {
+			cerr << "Could not read " << argv[i] << "\n";
+			return 1;
+		}
+		ostringstream data;
+		data << in.rdbuf();
+
+		auto filename = fs::path(argv[i]).filename().string();
+		inl << "\t{\"" << filename << "\", R\"__TEMPLATE__(" << data.str() << ")__TEMPLATE__\"},\n";
+
+		try {
+			compile(hpp, filename, data.str());
+		} catch (runtime_error &e) {
+			cerr << argv[i] << ": " << e.what() << "\n";
+			return 1;
+		}
 	}
 
-	out << "};\n";
+	inl << "};\n";
+	hpp << "}\n\n}\n";
+
+	inl.close();
+	hpp.close();
+	if (inl.fail() || hpp.fail()) {
+		cerr << "Could not write output files\n";
+		return 1;
+	}
 }
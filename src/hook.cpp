@@ -0,0 +1,194 @@
+/* LightBTS -- a lightweight issue tracking system
+   Copyright © 2018 Guus Sliepen <guus@lightbts.info>
+
+   SPDX-License-Identifier: GPL-3.0+
+*/
+
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <fmt/ostream.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "hook.hpp"
+
+using namespace std;
+using namespace fmt;
+namespace fs = boost::filesystem;
+
+namespace LightBTS {
+
+// Don't wait for a reply before sending more events than this, to avoid filling up both pipes.
+static const size_t max_pending = 64;
+
+HookProcess::HookProcess(const fs::path &hook, const fs::path &dir, chrono::seconds timeout): hook(hook), dir(dir), name(hook.filename().string()), timeout(timeout) {
+}
+
+HookProcess::~HookProcess() {
+	stop();
+}
+
+void HookProcess::start() {
+	int in[2];
+	int out[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, in))
+		throw runtime_error(format("Could not create socket for {} hook: {}", name, strerror(errno)));
+
+	if (pipe2(out, O_CLOEXEC)) {
+		close(in[0]);
+		close(in[1]);
+		throw runtime_error(format("Could not create pipe for {} hook: {}", name, strerror(errno)));
+	}
+
+	pid = fork();
+
+	if (pid < 0) {
+		for (auto fd: {in[0], in[1], out[0], out[1]})
+			close(fd);
+		throw runtime_error(format("Could not start {} hook: {}", name, strerror(errno)));
+	}
+
+	if (!pid) {
+		dup2(in[0], 0);
+		dup2(out[1], 1);
+		for (auto fd: {in[0], in[1], out[0], out[1]})
+			close(fd);
+		if (chdir(dir.c_str()) || setenv("LIGHTBTS_DIR", dir.c_str(), 1)) {
+			print(cerr, "Could not prepare environment for {} hook: {}\n", name, strerror(errno));
+			_exit(127);
+		}
+		execl(hook.c_str(), hook.c_str(), nullptr);
+		print(cerr, "Failed to execute {} hook: {}\n", name, strerror(errno));
+		_exit(127);
+	}
+
+	close(in[0]);
+	close(out[1]);
+	to_hook = in[1];
+	from_hook = out[0];
+	buffer.clear();
+}
+
+// A hook that hangs is killed, otherwise we wait for it to exit by itself.
+void HookProcess::stop(bool kill) {
+	if (pid < 0)
+		return;
+
+	if (kill)
+		::kill(pid, SIGKILL);
+
+	// Closing stdin tells the hook that there are no more events.
+	close(to_hook);
+	close(from_hook);
+	to_hook = -1;
+	from_hook = -1;
+	buffer.clear();
+
+	int status;
+	while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+		;
+	pid = -1;
+}
+
+bool HookProcess::send(const string &data) {
+	for (size_t pos = 0; pos < data.size();) {
+		auto sent = ::send(to_hook, data.data() + pos, data.size() - pos, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent < 0)
+			return false;
+		pos += sent;
+	}
+
+	return true;
+}
+
+// Read the next line from the hook, without the newline. Returns false if there is none within the timeout.
+bool HookProcess::receive(string &reply) {
+	auto deadline = chrono::steady_clock::now() + timeout;
+
+	while (true) {
+		auto newline = buffer.find('\n');
+		if (newline != buffer.npos) {
+			reply = buffer.substr(0, newline);
+			buffer.erase(0, newline + 1);
+			return true;
+		}
+
+		int wait = -1;
+		if (timeout.count()) {
+			auto left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+			if (left <= 0) {
+				print(cerr, "Error while executing {} hook, it did not reply within {} s\n", name, timeout.count());
+				return false;
+			}
+			wait = min<decltype(left)>(left, INT_MAX);
+		}
+
+		pollfd pfd{from_hook, POLLIN, 0};
+		int result = poll(&pfd, 1, wait);
+		if (result < 0 && errno != EINTR) {
+			print(cerr, "Error while waiting for {} hook: {}\n", name, strerror(errno));
+			return false;
+		}
+		if (result <= 0)
+			continue;
+
+		char buf[4096];
+		auto len = read(from_hook, buf, sizeof buf);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0) {
+			print(cerr, "Error while executing {} hook, it stopped before replying\n", name);
+			return false;
+		}
+		buffer.append(buf, len);
+	}
+}
+
+bool HookProcess::call(const string &event, const vector<pair<fs::path, string>> &messages) {
+	if (pid < 0)
+		start();
+
+	bool accepted = true;
+
+	for (size_t i = 0; i < messages.size(); i += max_pending) {
+		size_t end = min(messages.size(), i + max_pending);
+
+		string events;
+		for (size_t j = i; j < end; ++j)
+			events += format("{}\t{}\t{}\n", event, messages[j].first.string(), messages[j].second);
+
+		if (!send(events)) {
+			print(cerr, "Error while sending events to {} hook: {}\n", name, strerror(errno));
+			stop(true);
+			return false;
+		}
+
+		for (size_t j = i; j < end; ++j) {
+			string reply;
+			if (!receive(reply)) {
+				stop(true);
+				return false;
+			}
+
+			if (reply.compare(0, 6, "accept") == 0)
+				continue;
+			if (reply.compare(0, 6, "reject") != 0)
+				print(cerr, "Invalid reply from {} hook: {}\n", name, reply);
+			accepted = false;
+		}
+	}
+
+	return accepted;
+}
+
+}
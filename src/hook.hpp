@@ -0,0 +1,47 @@
+#pragma once
+
+/* LightBTS -- a lightweight issue tracking system
+   Copyright © 2018 Guus Sliepen <guus@lightbts.info>
+
+   SPDX-License-Identifier: GPL-3.0+
+*/
+
+#include <boost/filesystem.hpp>
+#include <chrono>
+#include <string>
+#include <sys/types.h>
+#include <utility>
+#include <vector>
+
+namespace LightBTS {
+
+/* A hook that is started once and then handles any number of events.
+ * Each event is sent to the hook's stdin as a line containing the event name,
+ * the path to the message file and the bug number, separated by tabs.
+ * For each event, the hook must write a line to its stdout starting with either "accept" or "reject".
+ * If the hook exits, misbehaves or does not reply in time, the events are rejected, and it is restarted for the next call.
+ */
+class HookProcess {
+	boost::filesystem::path hook;
+	boost::filesystem::path dir;
+	std::string name;
+	std::chrono::seconds timeout; // to wait for each reply, 0 to wait forever
+	pid_t pid = -1;
+	int to_hook = -1;        // a socket, so writing to a hook that exited fails with EPIPE instead of raising SIGPIPE
+	int from_hook = -1;
+	std::string buffer;      // replies that have been read but not handled yet
+
+	void start();
+	void stop(bool kill = false);
+	bool send(const std::string &data);
+	bool receive(std::string &reply);
+
+	public:
+	HookProcess(const boost::filesystem::path &hook, const boost::filesystem::path &dir, std::chrono::seconds timeout = {});
+	~HookProcess();
+
+	// Returns true if all messages, given as pairs of file and bug number, were accepted.
+	bool call(const std::string &event, const std::vector<std::pair<boost::filesystem::path, std::string>> &messages);
+};
+
+}
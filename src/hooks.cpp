@@ -0,0 +1,47 @@
+/* LightBTS -- a lightweight issue tracking system
+   Copyright © 2018 Guus Sliepen <guus@lightbts.info>
+
+   SPDX-License-Identifier: GPL-3.0+
+*/
+
+#include <fmt/ostream.h>
+#include <iostream>
+
+#include "hooks.hpp"
+
+#include "cli.hpp"
+#include "lightbts.hpp"
+
+using namespace std;
+using namespace fmt;
+
+static int do_hooks_run(const vector<string> &args) {
+	if (args.size() > 1) {
+		print(cerr, "Too many arguments\n");
+		return 1;
+	}
+
+	LightBTS::Instance bts(data_dir);
+	bts.set_no_hooks(no_hooks);
+
+	auto stats = bts.run_hook_queue(jobs);
+
+	if (verbose)
+		print(cerr, "{} hooks ran, {} failed and will be retried, {} given up, {} pending\n",
+		      stats.ran, stats.failed, stats.given_up, stats.pending);
+
+	return stats.failed || stats.given_up ? 1 : 0;
+}
+
+int do_hooks(const char *argv0, const vector<string> &args) {
+	if (args.empty()) {
+		print(cerr, "Missing subcommand\n");
+		return 1;
+	}
+
+	if (args[0] == "run")
+		return do_hooks_run(args);
+
+	print(cerr, "Unknown subcommand {}\n", args[0]);
+	return 1;
+}
@@ -4,49 +4,187 @@
    SPDX-License-Identifier: GPL-3.0+
 */
 
+#include <csignal>
 #include <fmt/ostream.h>
 #include <iostream>
+#include <memory>
+#include <sstream>
 
 #include "import.hpp"
 
+#include "bulk.hpp"
 #include "cli.hpp"
 #include "lightbts.hpp"
+#include "mailbox.hpp"
 
 using namespace std;
 using namespace fmt;
 
-static int import_one_file(LightBTS::Instance &bts, istream &file) {
-	LightBTS::Message msg;
-	msg.load(file);
-	if (!bts.import(msg))
-		return 1;
-	return 0;
-}
+static volatile sig_atomic_t interrupted;
 
-int do_import(const char *argv0, const vector<string> &args) {
-	LightBTS::Instance bts(data_dir);
+static void interrupt_handler(int) {
+	interrupted = 1;
+}
 
+struct Importer {
+	LightBTS::Instance &bts;
+	unique_ptr<LightBTS::BulkImport> bulk;
+	vector<string> files;
 	int result = 0;
 
-	if (args.empty()) {
-		import_one_file(bts, cin);
-	} else {
-		for (auto &&filename: args) {
-			ifstream file(filename);
-			if (!file.is_open()) {
-				print(cerr, "Could not open {}: {}\n", filename, strerror(errno));
+	Importer(LightBTS::Instance &bts): bts(bts) {}
+
+	void import(const LightBTS::Message &msg) {
+		if (bulk)
+			bulk->add(msg);
+		else
+			bts.import(msg);
+	}
+
+	// Plain message files are collected, so bulk imports can process them in parallel.
+	void flush_files() {
+		if (bulk) {
+			if (bulk->add_files(files, jobs))
 				result = 1;
-				continue;
+		} else {
+			for (auto &&filename: files) {
+				ifstream file(filename);
+				if (!file.is_open()) {
+					print(cerr, "Could not open {}: {}\n", filename, strerror(errno));
+					result = 1;
+					continue;
+				}
+				try {
+					LightBTS::Message msg;
+					msg.load(file);
+					bts.import(msg);
+				} catch (runtime_error &e) {
+					print(cerr, "Error parsing {}: {}\n", filename, e.what());
+					result = 1;
+					continue;
+				}
 			}
+		}
+
+		files.clear();
+	}
+
+	void import_mbox(LightBTS::MboxReader &reader, const string &name) {
+		string text;
+		uint64_t start;
+		size_t batches = bulk ? bulk->stats.batches : 0;
+
+		interrupted = 0;
+		auto old_handler = signal(SIGINT, interrupt_handler);
+
+		while (!interrupted && reader.next(text, start)) {
 			try {
-				import_one_file(bts, file);
+				istringstream in(text);
+				LightBTS::Message msg;
+				msg.load(in);
+				import(msg);
 			} catch (runtime_error &e) {
-				print(cerr, "Error parsing {}: {}\n", filename, e.what());
+				print(cerr, "Error parsing message at offset {} in {}: {}\n", start, name, e.what());
 				result = 1;
-				continue;
 			}
+
+			if (verbose && bulk && bulk->stats.batches != batches) {
+				batches = bulk->stats.batches;
+				print(cerr, "{}: imported up to offset {}\n", name, reader.get_offset());
+			}
+		}
+
+		signal(SIGINT, old_handler);
+
+		if (interrupted) {
+			if (bulk)
+				bulk->flush();
+			print(cerr, "Interrupted, resume with: lbts import --offset={} {}\n", reader.get_offset(), name);
+			result = 1;
+		}
+	}
+
+	void import_stdin() {
+		string first;
+
+		if (offset || (getline(cin, first) && LightBTS::MboxReader::is_separator(first))) {
+			LightBTS::MboxReader reader(cin, offset);
+			if (!offset)
+				reader.unread(first);
+			import_mbox(reader, "-");
+			return;
 		}
+
+		stringstream buffer;
+		buffer << first << '\n' << cin.rdbuf();
+		LightBTS::Message msg;
+		msg.load(buffer);
+		import(msg);
 	}
 
-	return 0;
+	void import_path(const string &filename) {
+		if (LightBTS::is_maildir(filename)) {
+			flush_files();
+			files = LightBTS::list_maildir(filename);
+			flush_files();
+			return;
+		}
+
+		ifstream file(filename);
+		string first;
+
+		if (!file.is_open() || !(offset || (getline(file, first) && LightBTS::MboxReader::is_separator(first)))) {
+			files.push_back(filename);
+			return;
+		}
+
+		flush_files();
+		file.clear();
+		LightBTS::MboxReader reader(file, offset);
+		if (!offset)
+			reader.unread(first);
+		import_mbox(reader, filename);
+	}
+};
+
+int do_import(const char *argv0, const vector<string> &args) {
+	auto &bts = open_instance();
+
+	Importer importer(bts);
+
+	if (bulk) {
+		size_t batch_size = LightBTS::BulkImport::default_batch_size;
+		auto batch_size_config = bts.get_config("import", "batch-size");
+		if (!batch_size_config.empty())
+			batch_size = stoul(batch_size_config);
+
+		importer.bulk.reset(new LightBTS::BulkImport(bts, batch_size));
+	}
+
+	if (args.empty()) {
+		importer.import_stdin();
+	} else {
+		for (auto &&filename: args) {
+			if (interrupted)
+				break;
+			importer.import_path(filename);
+		}
+		importer.flush_files();
+	}
+
+	if (!importer.bulk)
+		return importer.result;
+
+	importer.bulk->flush();
+
+	auto &&stats = importer.bulk->get_statistics();
+	print(cerr, "Imported {} of {} messages in {} batches, {:.3f} seconds ({:.0f} messages/second)\n",
+	      stats.imported, stats.messages, stats.batches, stats.seconds, stats.seconds > 0 ? stats.messages / stats.seconds : 0.0);
+	print(cerr, "{} new bugs, {} duplicates, {} rejected, {} failed\n",
+	      stats.new_bugs, stats.duplicates, stats.rejected, stats.failed);
+
+	if (stats.failed)
+		return 1;
+
+	return importer.result;
 }
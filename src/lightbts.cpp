@@ -4,9 +4,25 @@
    SPDX-License-Identifier: GPL-3.0+
 */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <sstream>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <fcntl.h>
 #include <limits.h>
+#include <strings.h>
+#include <sys/file.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <boost/filesystem.hpp>
 #include <boost/algorithm/string.hpp>
@@ -15,6 +31,10 @@
 #include <cstdio>
 
 #include "lightbts.hpp"
+#include "bulk.hpp"
+#include "hook.hpp"
+#include "mustache.hpp"
+#include "profile.hpp"
 #include "templates.inl"
 
 using namespace std;
@@ -92,10 +112,26 @@ int link_type_index(const string &name) {
 }
 
 Instance::Instance(const string &path, Flags flags) {
-	init(path, flags == Flags::INIT);
+	Profile::Timer timer("init");
+	read_only = flags & Flags::READ_ONLY;
+	init(path, flags & Flags::INIT, !(flags & Flags::NO_INDEX));
 }
 
 Instance::~Instance() {
+	profile_statements();
+
+	if (sql_statistics) {
+		auto &&stats = db.statement_statistics();
+		vector<pair<string, SQLite3::statement_stats>> sorted(stats.begin(), stats.end());
+		sort(sorted.begin(), sorted.end(), [](auto &a, auto &b) { return a.second.total_ns > b.second.total_ns; });
+
+		print(*sql_log, "{:>8} {:>12} {:>12} {:>12}  {}\n", "count", "total ms", "max ms", "scan steps", "statement");
+		for (auto &&it: sorted)
+			print(*sql_log, "{:>8} {:>12.3f} {:>12.3f} {:>12}  {}\n", it.second.count, it.second.total_ns / 1e6, it.second.max_ns / 1e6, it.second.full_scan_steps, it.first);
+	}
+
+	// Query plans are logged when the database is closed, so do that while the log is still open.
+	db.close();
 }
 
 string Instance::get_config(const string &section, const string &variable) {
@@ -144,9 +180,184 @@ string Instance::get_local_email_address() {
 		return format("{} <{}>", fullname, address);
 }
 
+/* Full-text index over the subject and text of every message.
+ * The table is contentless, the text itself is already in the message store.
+ * Its rowids are the ids of the messages table.
+ * Matches in the title weigh more than matches in the body.
+ */
+static void create_search_index(SQLite3::database &db) {
+	db.execute("CREATE VIRTUAL TABLE search USING fts5(title, body, content='', tokenize='porter unicode61')");
+	db.execute("INSERT INTO search (search, rank) VALUES ('rank', 'bm25(10.0, 1.0)')");
+}
+
+/* Messages are numbered in the order they were indexed.
+ * The number is an explicit column, so it cannot be changed by VACUUM,
+ * as thread keys and the rowids of the search index refer to it.
+ */
+static void create_messages_table(SQLite3::database &db) {
+	db.execute("CREATE TABLE messages (id INTEGER PRIMARY KEY AUTOINCREMENT, msgid TEXT UNIQUE, bug INTEGER, spam INTEGER NOT NULL DEFAULT 0, date INTEGER, date_text TEXT, sender TEXT, recipient TEXT, subject TEXT, parent TEXT, snippet TEXT, length INTEGER, depth INTEGER NOT NULL DEFAULT 0, thread TEXT, FOREIGN KEY(bug) REFERENCES bugs(id))");
+	db.execute("CREATE INDEX messages_thread_index ON messages (bug, thread)");
+}
+
+// Hooks that are run later by lbts hooks run, so they do not slow down the command that triggered them.
+static void create_hook_queue(SQLite3::database &db) {
+	db.execute("CREATE TABLE hook_queue (id INTEGER PRIMARY KEY AUTOINCREMENT, hook TEXT NOT NULL, msgid TEXT NOT NULL, bug INTEGER, attempts INTEGER NOT NULL DEFAULT 0, next_attempt INTEGER NOT NULL DEFAULT 0)");
+}
+
+/* The time in a Received: header, which follows the last semicolon, or in a Date: header.
+ * The day of the week and the seconds are optional, and the obsolete named time zones of RFC 5322 are understood.
+ * Unknown time zones, including the military ones, are taken to be UTC.
+ */
+static time_t parse_date(std::string_view value) {
+	auto semicolon = value.rfind(';');
+	if (semicolon != value.npos)
+		value.remove_prefix(semicolon + 1);
+
+	string str(value);
+	const char *p = str.c_str();
+	struct tm tm{};
+
+	auto comma = str.find(',');
+	if (comma != str.npos)
+		p += comma + 1;
+
+	p = strptime(p, " %d %b %Y %H:%M", &tm);
+	if (!p)
+		return 0;
+
+	if (*p == ':' && !(p = strptime(p, ":%S", &tm)))
+		return 0;
+
+	while (*p == ' ' || *p == '\t')
+		p++;
+
+	long offset = 0;
+
+	if ((*p == '+' || *p == '-') && isdigit(p[1]) && isdigit(p[2]) && isdigit(p[3]) && isdigit(p[4])) {
+		int hours = (p[1] - '0') * 10 + (p[2] - '0');
+		int minutes = (p[3] - '0') * 10 + (p[4] - '0');
+		offset = (hours * 60 + minutes) * 60;
+		if (*p == '-')
+			offset = -offset;
+	} else {
+		static const pair<const char *, int> zones[] = {
+			{"UT", 0}, {"GMT", 0},
+			{"EST", -5}, {"EDT", -4},
+			{"CST", -6}, {"CDT", -5},
+			{"MST", -7}, {"MDT", -6},
+			{"PST", -8}, {"PDT", -7},
+		};
+
+		auto end = p;
+		while (isalpha(*end))
+			end++;
+
+		std::string_view zone(p, end - p);
+		for (auto &&[name, hours]: zones)
+			if (zone == name)
+				offset = hours * 3600;
+	}
+
+	return timegm(&tm) - offset;
+}
+
+/* The start of the text of a message, as shown by lbts show.
+ * It is cached in the index, so showing a ticket does not have to read and decode its first message.
+ */
+string make_snippet(std::string_view text) {
+	const size_t max_lines = 10;
+	const size_t max_size = 4096;
+
+	std::string_view::size_type pos = 0;
+	for (size_t i = 0; i < max_lines && pos != text.npos; i++) {
+		pos = text.find('\n', pos);
+		if (pos != text.npos)
+			pos++;
+	}
+
+	// Don't cut a UTF-8 sequence in half.
+	if (pos > max_size) {
+		pos = max_size;
+		while (pos && (text[pos] & 0xc0) == 0x80)
+			pos--;
+	}
+
+	return string(text.substr(0, pos));
+}
+
+/* Messages are sorted into reply threads by their thread column,
+ * which is the thread of their parent followed by the key of the message itself.
+ * Replies to the same message are in the order they were indexed.
+ */
+static string thread_key(int64_t id) {
+	return format("{:016x}", id);
+}
+
+/* Statement tracing is configured in the debug section.
+ * Messages go to the file in debug.sql-log, or to stderr if that is not set.
+ */
+void Instance::init_tracing() {
+	auto slow_query = config.get("debug", "slow-query");
+	bool explain_scans = config.get_bool("debug", "explain-scans", false);
+	sql_statistics = config.get_bool("debug", "sql-statistics", false);
+
+	if (slow_query.empty() && !explain_scans && !sql_statistics)
+		return;
+
+	auto log_file = config.get("debug", "sql-log");
+	if (log_file.empty()) {
+		sql_log = &cerr;
+	} else {
+		sql_log_file = make_unique<ofstream>(fs::absolute(log_file, base_dir).string(), ios::app);
+		if (!sql_log_file->is_open())
+			throw runtime_error(format("Could not open SQL log {}", log_file));
+		sql_log = sql_log_file.get();
+	}
+
+	SQLite3::trace_options options;
+	options.log = [this](const string &message) { print(*sql_log, "{}\n", message); };
+	if (!slow_query.empty())
+		options.slow_ns = stod(slow_query) * 1e6;
+	options.explain_scans = explain_scans;
+	options.statistics = sql_statistics;
+	db.set_tracing(options);
+}
+
+// Add the statements run since the last call to the profile.
+void Instance::profile_statements() {
+	auto misses = db.cache_misses();
+	auto executed = db.statements_executed();
+	if (Profile::enabled)
+		Profile::add_statements(misses - profiled_misses, executed - profiled_executed);
+	profiled_misses = misses;
+	profiled_executed = executed;
+}
+
+// Statements run so far are not added to the profile.
+void Instance::skip_profiled_statements() {
+	profiled_misses = db.cache_misses();
+	profiled_executed = db.statements_executed();
+}
+
 void Instance::init_index(const fs::path &filename) {
-	db.open(filename.string());
+	Profile::Timer timer("init.index");
+
+	db.open(filename.string(), read_only);
+	// A cached instance can be used by later requests that do ask for a profile.
+	db.set_profile([](const char *, int64_t ns) {
+		if (Profile::enabled)
+			Profile::add("sqlite", chrono::nanoseconds(ns));
+	});
+	db.set_busy_timeout(busy_timeout);
 	db.execute("PRAGMA foreign_key = on");
+
+	/* Use write-ahead logging, so readers do not block while messages are imported,
+	 * and a writer does not have to wait for readers to finish.
+	 * The journal mode is stored in the database file, so only change it once.
+	 */
+	if (db.execute("PRAGMA journal_mode").get_string(0) != "wal" && !read_only)
+		db.execute("PRAGMA journal_mode=WAL");
+
 	auto version = db.execute("PRAGMA user_version").get_int(0);
 	auto appid_record = db.execute("PRAGMA application_id");
 	int appid = 0;
@@ -157,6 +368,13 @@ void Instance::init_index(const fs::path &filename) {
 		if (appid != 0x4c425453)
 			throw runtime_error("Index is a SQLite database not created by LightBTS!");
 
+	// A read-only index cannot be created or upgraded, that is left to the commands that write to it.
+	if (read_only) {
+		if (version != 8)
+			throw runtime_error(format("Index version {} is not current, run any other lbts command to upgrade it", version));
+		return;
+	}
+
 	if (!appid)
 		db.execute("PRAGMA application_id=0x4c425453");
 
@@ -164,37 +382,160 @@ void Instance::init_index(const fs::path &filename) {
 		print(cerr, "Creating index...\n");
 
 		auto tx = db.begin();
-		db.execute("CREATE TABLE bugs (id INTEGER PRIMARY KEY AUTOINCREMENT, status INTEGER NOT NULL DEFAULT 1, severity INTEGER NOT NULL DEFAULT 2, title TEXT, owner TEXT, submitter TEXT, date INTEGER, deadline INTEGER, progress INTEGER NOT NULL DEFAULT 0, milestone TEXT)");
-		db.execute("CREATE TABLE links (a INTEGER, b INTEGER, type INTEGER, PRIMARY KEY(a, b), FOREIGN KEY(a) REFERENCES bugs(id), FOREIGN KEY(b) REFERENCES bugs(id))");
-		db.execute("CREATE INDEX links_a_index ON links (a)");
-		db.execute("CREATE INDEX links_b_index ON links (b)");
-		db.execute("CREATE TABLE messages (msgid PRIMARY KEY, bug INTEGER, spam INTEGER NOT NULL DEFAULT 0, date INTEGER, FOREIGN KEY(bug) REFERENCES bugs(id))");
-		db.execute("CREATE TABLE recipients (bug INTEGER, address TEXT, PRIMARY KEY(bug, address), FOREIGN KEY(bug) REFERENCES bugs(id))");
-		db.execute("CREATE INDEX recipients_bug_index ON recipients (bug)");
-		db.execute("CREATE INDEX recipients_address_index ON recipients (address)");
-		db.execute("CREATE TABLE tags (bug INTEGER, tag TEXT, PRIMARY KEY(bug, tag), FOREIGN KEY(bug) REFERENCES bugs(id))");
-		db.execute("CREATE INDEX tags_bug_index ON tags (bug)");
-		db.execute("CREATE INDEX tags_tag_index ON tags (tag)");
-		db.execute("CREATE TABLE versions (bug INTEGER, version TEXT, status INTEGER NOT NULL DEFAULT 1, PRIMARY KEY(bug, version))");
-		db.execute("CREATE INDEX versions_bug_index ON versions (bug)");
-		db.execute("CREATE INDEX versions_version_index ON versions (version)");
-		db.execute("PRAGMA user_version=4");
+
+		// Another process might have created the index while we waited for the lock
+		if (!db.execute("PRAGMA user_version").get_int(0)) {
+			db.execute("CREATE TABLE bugs (id INTEGER PRIMARY KEY AUTOINCREMENT, status INTEGER NOT NULL DEFAULT 1, severity INTEGER NOT NULL DEFAULT 2, title TEXT, owner TEXT, submitter TEXT, date INTEGER, deadline INTEGER, progress INTEGER NOT NULL DEFAULT 0, milestone TEXT)");
+			db.execute("CREATE TABLE links (a INTEGER, b INTEGER, type INTEGER, PRIMARY KEY(a, b), FOREIGN KEY(a) REFERENCES bugs(id), FOREIGN KEY(b) REFERENCES bugs(id))");
+			db.execute("CREATE INDEX links_a_index ON links (a)");
+			db.execute("CREATE INDEX links_b_index ON links (b)");
+			create_messages_table(db);
+			db.execute("CREATE TABLE recipients (bug INTEGER, address TEXT, PRIMARY KEY(bug, address), FOREIGN KEY(bug) REFERENCES bugs(id))");
+			db.execute("CREATE INDEX recipients_bug_index ON recipients (bug)");
+			db.execute("CREATE INDEX recipients_address_index ON recipients (address)");
+			db.execute("CREATE TABLE tags (bug INTEGER, tag TEXT, PRIMARY KEY(bug, tag), FOREIGN KEY(bug) REFERENCES bugs(id))");
+			db.execute("CREATE INDEX tags_bug_index ON tags (bug)");
+			db.execute("CREATE INDEX tags_tag_index ON tags (tag)");
+			db.execute("CREATE TABLE versions (bug INTEGER, version TEXT, status INTEGER NOT NULL DEFAULT 1, PRIMARY KEY(bug, version))");
+			db.execute("CREATE INDEX versions_bug_index ON versions (bug)");
+			db.execute("CREATE INDEX versions_version_index ON versions (version)");
+			create_search_index(db);
+			create_hook_queue(db);
+			db.execute("PRAGMA user_version=8");
+		}
+
 		if (!tx.commit())
 			throw runtime_error("Failed to create index");
 
-		version = 4;
+		version = 8;
 	}
 
-	if (version < 0 || version > 4)
+	if (version < 0 || version > 8)
 		throw runtime_error(format("Unknown index version {}", version));
 
 	if (version < 4) {
-		print(cerr, "Old index, use the Python prototype of LightBTS to upgrade to version 4!");
+		print(cerr, "Old index, use lbts reindex to rebuild it!\n");
 		throw runtime_error(format("Unsupported index version {}", version));
 	}
+
+	if (version == 4) {
+		print(cerr, "Upgrading index to version 5, building the full-text search index...\n");
+
+		auto tx = db.begin();
+
+		// Another process might have upgraded the index while we waited for the lock
+		if (db.execute("PRAGMA user_version").get_int(0) == 4) {
+			create_search_index(db);
+			for (auto &&row: db.execute("SELECT rowid, msgid FROM messages")) {
+				try {
+					auto msg = get_message(row.get_string(1));
+					add_search_text(row.get_int64(0), msg["Subject"], msg.get_text());
+				} catch (runtime_error &e) {
+					print(cerr, "Could not add message {} to the search index: {}\n", row.get_string(1), e.what());
+				}
+			}
+			db.execute("PRAGMA user_version=5");
+		}
+
+		if (!tx.commit())
+			throw runtime_error("Failed to upgrade index");
+
+		version = 5;
+	}
+
+	if (version == 5) {
+		auto tx = db.begin();
+
+		if (db.execute("PRAGMA user_version").get_int(0) == 5) {
+			create_hook_queue(db);
+			db.execute("PRAGMA user_version=6");
+		}
+
+		if (!tx.commit())
+			throw runtime_error("Failed to upgrade index");
+
+		version = 6;
+	}
+
+	if (version == 6) {
+		print(cerr, "Upgrading index to version 7, caching message headers...\n");
+
+		auto tx = db.begin();
+
+		if (db.execute("PRAGMA user_version").get_int(0) == 6) {
+			for (auto column: {"date_text TEXT", "sender TEXT", "recipient TEXT", "subject TEXT", "parent TEXT", "snippet TEXT", "length INTEGER"})
+				db.execute(format("ALTER TABLE messages ADD COLUMN {}", column));
+
+			vector<pair<int64_t, string>> rows;
+			for (auto &&row: db.execute("SELECT rowid, msgid FROM messages"))
+				rows.emplace_back(row.get_int64(0), row.get_string(1));
+
+			// Messages that cannot be read are left uncached, show falls back to the message store for them.
+			for (auto &&row: rows) {
+				try {
+					auto msg = get_message(row.second);
+					auto text = msg.get_text();
+					auto snippet = make_snippet(text);
+					db.execute("UPDATE messages SET date=?, date_text=?, sender=?, recipient=?, subject=?, parent=?, snippet=?, length=? WHERE rowid=?", int64_t(parse_date(msg["Date"])), msg["Date"], msg["From"], msg["To"], msg["Subject"], unquote(msg["In-Reply-To"]), snippet, int64_t(text.size()), row.first);
+				} catch (runtime_error &e) {
+					print(cerr, "Could not cache the headers of message {}: {}\n", row.second, e.what());
+				}
+			}
+
+			db.execute("PRAGMA user_version=7");
+		}
+
+		if (!tx.commit())
+			throw runtime_error("Failed to upgrade index");
+
+		version = 7;
+	}
+
+	if (version == 7) {
+		auto tx = db.begin();
+
+		if (db.execute("PRAGMA user_version").get_int(0) == 7) {
+			// The table is rebuilt with an explicit id, which keeps the implicit rowid it had so far.
+			db.execute("ALTER TABLE messages RENAME TO old_messages");
+			create_messages_table(db);
+			db.execute("INSERT INTO messages (id, msgid, bug, spam, date, date_text, sender, recipient, subject, parent, snippet, length)"
+			           " SELECT rowid, msgid, bug, spam, date, date_text, sender, recipient, subject, parent, snippet, length FROM old_messages");
+			db.execute("DROP TABLE old_messages");
+
+			// Parents were always indexed before their replies.
+			struct position {
+				int depth;
+				string thread;
+			};
+			unordered_map<string, position> positions;
+			vector<pair<int64_t, position>> updates;
+
+			for (auto &&row: db.execute("SELECT id, msgid, parent FROM messages ORDER BY id")) {
+				auto id = row.get_int64(0);
+				position pos{0, thread_key(id)};
+				auto it = positions.find(row.get_string(2));
+				if (it != positions.end())
+					pos = {it->second.depth + 1, it->second.thread + pos.thread};
+				positions[row.get_string(1)] = pos;
+				updates.emplace_back(id, std::move(pos));
+			}
+
+			for (auto &&update: updates)
+				db.execute("UPDATE messages SET depth=?, thread=? WHERE id=?", update.second.depth, update.second.thread, update.first);
+
+			db.execute("PRAGMA user_version=8");
+		}
+
+		if (!tx.commit())
+			throw runtime_error("Failed to upgrade index");
+	}
+}
+
+void Instance::add_search_text(int64_t id, const string &title, const string &text) {
+	db.execute("INSERT INTO search (rowid, title, body) VALUES (?, ?, ?)", id, title, text);
 }
 
-void Instance::init(const fs::path &start_dir, bool create) {
+static fs::path start_dir_or_default(const fs::path &start_dir) {
 	fs::path dir = start_dir;
 
 	if (dir.empty()) {
@@ -206,32 +547,67 @@ void Instance::init(const fs::path &start_dir, bool create) {
 	if (dir.empty())
 		dir = fs::current_path();
 
+	return dir;
+}
+
+/* Find the data directory of the instance that contains the given directory,
+ * or the current working directory if none is given.
+ */
+fs::path Instance::find(const fs::path &start_dir) {
+	Profile::Timer timer("init.find");
+	fs::path dir = start_dir_or_default(start_dir);
+
+	while (true) {
+		if (fs::exists(dir / ".lightbts" / "config"))
+			return dir / ".lightbts";
+
+		auto parent = dir.parent_path();
+		if (parent == dir)
+			throw runtime_error("No LightBTS instance found");
+		dir = parent;
+	}
+}
+
+static int64_t mtime_ns(const struct stat &st) {
+	return int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+/* Whether the configuration or the index has been replaced since this instance was opened,
+ * for example by another process.
+ */
+bool Instance::is_stale() {
+	struct stat st;
+	if (stat((base_dir / "config").string().c_str(), &st) || mtime_ns(st) != config_mtime)
+		return true;
+	if (stat(dbfile.string().c_str(), &st) || uint64_t(st.st_ino) != index_inode)
+		return true;
+	return false;
+}
+
+// A persistent hook that takes longer than this to reply is stuck, 0 can be used to wait forever.
+static const unsigned long max_hook_timeout = 24 * 60 * 60;
+
+void Instance::init(const fs::path &start_dir, bool create, bool open_index) {
 	if (create) {
+		fs::path dir = start_dir_or_default(start_dir);
 		if (fs::exists(dir / ".lightbts" / "config"))
 			throw runtime_error("LightBTS instance already exists");
+		base_dir = dir / ".lightbts";
 	} else {
-		while (true) {
-			if (fs::exists(dir / ".lightbts" / "config"))
-				break;
-
-			auto parent = dir.parent_path();
-			if (parent == dir)
-				throw runtime_error("No LightBTS instance found");
-			dir = parent;
-		}
+		base_dir = find(start_dir);
 	}
 
-	base_dir = dir / ".lightbts";
-
 	if (create && !fs::exists(base_dir / "config")) {
 		config.set("core", "index", "index");
 		config.set("core", "messages", "messages");
+		config.set("core", "message-store", "files");
 		config.set("core", "hooks", "hooks");
 		config.set("core", "templates", "templates");
 		config.set("core", "project", "");
 		config.set("core", "admin", "");
 		config.set_bool("core", "respond-to-new", true);
 		config.set_bool("core", "respond-to-reply", true);
+		config.set("core", "busy-timeout", "5000");
 
 		config.set("email", "address", "");
 		config.set("email", "name", "");
@@ -240,6 +616,7 @@ void Instance::init(const fs::path &start_dir, bool create) {
 		config.set("web", "root", "");
 		config.set("web", "static-root", "");
 	} else {
+		Profile::Timer timer("init.config");
 		config.load(base_dir / "config");
 	}
 
@@ -248,10 +625,25 @@ void Instance::init(const fs::path &start_dir, bool create) {
 	maildir = fs::absolute(config.get("core", "messages", "messages"), base_dir);
 	hookdir = fs::absolute(config.get("core", "hooks", "hooks"), base_dir);
 	templatedir = fs::absolute(config.get("core", "templates", "templates"), base_dir);
+	auto message_store = config.get("core", "message-store", "files");
 	project = config.get("core", "project");
 	admin = config.get("core", "admin");
 	respond_to_new = config.get_bool("core", "respond-to-new", true);
 	respond_to_reply = config.get_bool("core", "respond-to-reply", true);
+	busy_timeout = stoi(config.get("core", "busy-timeout", "5000"));
+
+	queue_hooks = config.get_bool("hooks", "queue", false);
+	max_hook_attempts = stoul(config.get("hooks", "max-attempts", "5"));
+	hook_retry_delay = stoul(config.get("hooks", "retry-delay", "60"));
+	auto timeout = stoul(config.get("hooks", "timeout", "60"));
+	if (timeout > max_hook_timeout)
+		throw runtime_error(format("Invalid hooks.timeout, it must be at most {} seconds", max_hook_timeout));
+	hook_timeout = chrono::seconds(timeout);
+
+	persistent_hooks.clear();
+	istringstream hook_names(config.get("hooks", "persistent"));
+	for (string name; hook_names >> name;)
+		persistent_hooks.insert(name);
 
 	// Email configuration
 	emailaddress = config.get("email", "address");
@@ -265,6 +657,7 @@ void Instance::init(const fs::path &start_dir, bool create) {
 	// Create directories if necessary
 	fs::create_directories(base_dir);
 	fs::create_directories(maildir);
+	messages = MessageStore::open(message_store, maildir);
 	if (create) {
 		fs::create_directories(hookdir);
 		fs::create_directories(templatedir);
@@ -286,69 +679,282 @@ void Instance::init(const fs::path &start_dir, bool create) {
 		}
 	}
 
+	// SQL tracing, for finding slow queries
+	init_tracing();
+
 	// Initialize the index
-	init_index(dbfile);
+	if (open_index)
+		init_index(dbfile);
 
 	// Store initial configuration
 	if (create) {
 		config.save(base_dir / "config");
 	}
+
+	struct stat st;
+	if (!stat((base_dir / "config").string().c_str(), &st))
+		config_mtime = mtime_ns(st);
+	if (!stat(dbfile.string().c_str(), &st))
+		index_inode = st.st_ino;
 }
 
-vector<Ticket> Instance::list(const vector<string> &args, size_t len) {
-	string cmd = "SELECT id, title, status, severity FROM bugs WHERE 1";
+static const char *find_builtin_template(const string &name) {
+	for (auto &&tmpl: templates)
+		if (name == tmpl.filename)
+			return tmpl.data;
 
-	// apply filters
+	return nullptr;
+}
+
+/* A template from the template directory,
+ * or the built-in one if it has not been installed there.
+ */
+string Instance::get_template(const string &name) {
+	ifstream in((templatedir / name).string());
+	if (in.is_open()) {
+		ostringstream data;
+		data << in.rdbuf();
+		return data.str();
+	}
+
+	if (auto builtin = find_builtin_template(name))
+		return builtin;
+
+	throw runtime_error(format("Unknown template {}", name));
+}
+
+/* Templates are parsed once, and again only when the file in the template directory
+ * changes, appears or disappears, as seen by its modification time and size.
+ */
+Instance::template_state &Instance::check_template(const string &name) {
+	struct stat st;
+	bool exists = !stat((templatedir / name).string().c_str(), &st);
+	int64_t mtime = exists ? mtime_ns(st) : 0;
+	off_t size = exists ? st.st_size : -1;
+
+	auto &state = template_states[name];
+	if (state.compiled && state.mtime == mtime && state.size == size)
+		return state;
+
+	auto text = get_template(name);
+	auto builtin = find_builtin_template(name);
+	bool is_builtin = builtin && text == builtin;
+	auto compiled = make_shared<const Mustache::Template>(move(text));
+
+	state.mtime = mtime;
+	state.size = size;
+	state.builtin = is_builtin;
+	state.compiled = move(compiled);
+	return state;
+}
+
+/* Whether get_template() would return the built-in template,
+ * so the compiled version of it can be used instead.
+ */
+bool Instance::is_builtin_template(const string &name) {
+	return check_template(name).builtin;
+}
+
+// The parsed template, shared so it stays valid while it is being rendered even if the file changes.
+std::shared_ptr<const Mustache::Template> Instance::get_compiled_template(const string &name) {
+	return check_template(name).compiled;
+}
+
+/* Filters shared by list() and search().
+ * Arguments are status names, severity names, or otherwise tags.
+ * Without a status argument only open bugs match.
+ */
+struct Filter {
 	int status = 1;
 	vector<int> severities;
 	vector<string> tags;
 
-	for (size_t i = 0; i < len; i++) {
-		if (args[i] == "all") {
-			status = -1;
-		} else if (args[i] == "closed") {
-			status = 0;
-		} else if (args[i] == "open") {
-			status = 1;
-		} else if (is_valid_severity(args[i])) {
-			severities.push_back(severity_index(args[i]));
-		} else {
-			tags.push_back(args[i]);
+	Filter(const vector<string> &args, size_t len) {
+		for (size_t i = 0; i < len; i++) {
+			if (args[i] == "all") {
+				status = -1;
+			} else if (args[i] == "closed") {
+				status = 0;
+			} else if (args[i] == "open") {
+				status = 1;
+			} else if (is_valid_severity(args[i])) {
+				severities.push_back(severity_index(args[i]));
+			} else {
+				tags.push_back(args[i]);
+			}
 		}
 	}
 
-	if (status != -1)
-		cmd += " AND status=?";
+	string sql() const {
+		string cmd;
 
-	if (!severities.empty()) {
-		cmd += " AND (0";
-		for (auto &&severity: severities)
-			cmd += " OR severity=?";
-		cmd += ")";
+		if (status != -1)
+			cmd += " AND status=?";
+
+		if (!severities.empty()) {
+			cmd += " AND (0";
+			for (size_t i = 0; i < severities.size(); i++)
+				cmd += " OR severity=?";
+			cmd += ")";
+		}
+
+		if (!tags.empty()) {
+			cmd += " AND (0";
+			for (size_t i = 0; i < tags.size(); i++)
+				cmd += " OR EXISTS (SELECT 1 FROM tags WHERE tags.bug=bugs.id AND tag=?)";
+			cmd += ")";
+		}
+
+		return cmd;
 	}
 
-	if (!tags.empty()) {
-		cmd += " AND (0";
+	void bind(SQLite3::statement &stmt) const {
+		if (status != -1)
+			stmt.bind(status);
+		for (auto &&severity: severities)
+			stmt.bind(severity);
 		for (auto &&tag: tags)
-			cmd += " OR EXISTS (SELECT 1 FROM tags WHERE bug=id AND tag=?)";
-		cmd += ")";
+			stmt.bind(tag);
+	}
+};
+
+bool TicketCursor::next() {
+	if (limit && count == limit) {
+		// The query asks for one row more than the limit, to know whether there is a next page.
+		more = stmt.step() == SQLITE_ROW;
+		return false;
+	}
+
+	if (stmt.step() != SQLITE_ROW)
+		return false;
+
+	ticket = Ticket(stmt.column_string(0), stmt.column_string(1), static_cast<Status>(stmt.column_int(2)), static_cast<Severity>(stmt.column_int(3)));
+	count++;
+	return true;
+}
+
+string TicketCursor::get_continuation() const {
+	if (!more)
+		return {};
+
+	if (order == ListQuery::Order::SEVERITY)
+		return format("{}.{}", static_cast<int>(ticket.get_severity()), ticket.get_id());
+	else
+		return ticket.get_id();
+}
+
+TicketCursor Instance::list_cursor(const vector<string> &args, size_t len, const ListQuery &query) {
+	Filter filter(args, len);
+	string cmd = "SELECT id, title, status, severity FROM bugs WHERE 1" + filter.sql();
+	int64_t after_id = 0;
+	int after_severity = 0;
+
+	if (!query.after.empty()) {
+		char *end;
+		const char *token = query.after.c_str();
+
+		if (query.order == ListQuery::Order::SEVERITY) {
+			after_severity = strtol(token, &end, 10);
+			if (*end != '.')
+				throw runtime_error("Invalid continuation token");
+			token = end + 1;
+		}
+
+		after_id = strtoll(token, &end, 10);
+		if (*end || end == token)
+			throw runtime_error("Invalid continuation token");
+
+		if (query.order == ListQuery::Order::SEVERITY)
+			cmd += " AND (severity<? OR (severity=? AND id>?))";
+		else
+			cmd += " AND id>?";
 	}
 
+	if (query.order == ListQuery::Order::SEVERITY)
+		cmd += " ORDER BY severity DESC, id";
+	else
+		cmd += " ORDER BY id";
+
+	if (query.limit)
+		cmd += " LIMIT ?";
+
 	auto stmt = db.prepare(cmd);
-	if (status != -1)
-		stmt.bind(status);
-	for (auto &&severity: severities)
-		stmt.bind(severity);
-	for (auto &&tag: tags)
-		stmt.bind(tag);
+	filter.bind(stmt);
+
+	if (!query.after.empty()) {
+		if (query.order == ListQuery::Order::SEVERITY)
+			stmt.bind(after_severity, after_severity);
+		stmt.bind(after_id);
+	}
+
+	if (query.limit)
+		stmt.bind(static_cast<int64_t>(query.limit + 1));
 
+	return TicketCursor(std::move(stmt), query);
+}
+
+vector<Ticket> Instance::list(const vector<string> &args, size_t len) {
 	vector<Ticket> tickets;
-	while(stmt.step() == SQLITE_ROW)
+
+	for (auto &&ticket: list_cursor(args, len))
+		tickets.push_back(ticket);
+
+	return tickets;
+}
+
+vector<Ticket> Instance::search(const string &query, const vector<string> &args, size_t len) {
+	Filter filter(args, len);
+
+	// Rank each bug by its best matching message, lower bm25() scores are better.
+	// Using the rank column instead of calling bm25() directly allows SQLite to flatten the subquery.
+	auto stmt = db.prepare(
+		"SELECT id, title, status, severity FROM bugs"
+		" JOIN (SELECT messages.bug AS bug, min(hits.score) AS score"
+		"  FROM (SELECT rowid, rank AS score FROM search WHERE search MATCH ?) AS hits"
+		"  JOIN messages ON messages.id=hits.rowid WHERE NOT messages.spam GROUP BY messages.bug) AS ranked"
+		" ON ranked.bug=bugs.id WHERE 1" + filter.sql() +
+		" ORDER BY ranked.score, bugs.id");
+	stmt.bind(query);
+	filter.bind(stmt);
+
+	vector<Ticket> tickets;
+	int status;
+	while((status = stmt.step()) == SQLITE_ROW)
 		tickets.emplace_back(stmt.column_string(0), stmt.column_string(1), static_cast<Status>(stmt.column_int(2)), static_cast<Severity>(stmt.column_int(3)));
 
+	// Syntax errors in the query only show up when stepping
+	if (status != SQLITE_DONE)
+		throw db.last_error();
+
 	return tickets;
 }
 
+vector<pair<string, size_t>> Instance::count_tags(const vector<string> &args, size_t len) {
+	Filter filter(args, len);
+
+	auto stmt = db.prepare("SELECT tag, count(*) FROM tags JOIN bugs ON bugs.id=tags.bug WHERE 1" + filter.sql() + " GROUP BY tag ORDER BY tag");
+	filter.bind(stmt);
+
+	vector<pair<string, size_t>> tags;
+	while(stmt.step() == SQLITE_ROW)
+		tags.emplace_back(stmt.column_string(0), stmt.column_int64(1));
+
+	return tags;
+}
+
+vector<pair<string, size_t>> Instance::count_milestones(const vector<string> &args, size_t len) {
+	Filter filter(args, len);
+
+	auto stmt = db.prepare("SELECT milestone, count(*) FROM bugs WHERE milestone <> ''" + filter.sql() + " GROUP BY milestone ORDER BY milestone");
+	filter.bind(stmt);
+
+	vector<pair<string, size_t>> milestones;
+	while(stmt.step() == SQLITE_ROW)
+		milestones.emplace_back(stmt.column_string(0), stmt.column_int64(1));
+
+	return milestones;
+}
+
 Ticket Instance::get_ticket_from_ticket_id(const string &id) {
 	auto row = db.execute("SELECT id, title, status, severity FROM bugs WHERE id=?", id);
 	return Ticket(row.get_string(0), row.get_string(1), static_cast<Status>(row.get_int(2)), static_cast<Severity>(row.get_int(3)));
@@ -392,22 +998,446 @@ static string hash_msgid(const string &id) {
 }
 
 Message Instance::get_message(const string &id) {
-	string hash = hash_msgid(id);
-
-	fs::path filename = fs::path(maildir) / hash.substr(0, 2) / hash.substr(2);
+	istringstream data(messages->load(hash_msgid(id)));
 
 	Message message;
-	message.load(filename.string());
+	message.load(data);
 
 	return message;
 }
 
-fs::path Instance::store(const Message &msg) {
+MessageView Instance::get_message_view(const string &id) {
+	return messages->map(hash_msgid(id));
+}
+
+// The Message-ID as it is stored in the index.
+string Instance::get_msgid(const Message &msg) {
+	return unquote(msg["Message-ID"]);
+}
+
+// Whether a message with the same Message-ID has already been indexed.
+bool Instance::is_duplicate(const Message &msg) {
+	return db.execute("SELECT 1 FROM messages WHERE msgid=?", get_msgid(msg));
+}
+
+string Instance::store(const Message &msg) {
+	Profile::Timer timer("store");
 	string hash = hash_msgid(msg["Message-ID"]);
-	fs::create_directory(fs::path(maildir) / hash.substr(0, 2));
-	fs::path filename = fs::path(maildir) / hash.substr(0, 2) / hash.substr(2);
-	msg.save(filename.string());
-	return filename;
+	messages->store(hash, msg.to_string());
+	return hash;
+}
+
+/* Messages are only indexed while holding the index write lock, and are stored again then if they are missing.
+ * Holding the same lock from reading the live set until the store has been rewritten
+ * means a message is either in the live set, or indexed after the compaction has finished.
+ */
+MessageStore::compact_stats Instance::compact() {
+	auto tx = db.begin();
+	set<string> live;
+
+	for (auto &&row: db.execute("SELECT msgid FROM messages"))
+		live.insert(hash_msgid(row.get_string(0)));
+
+	auto stats = messages->compact(live);
+
+	if (!tx.commit())
+		throw runtime_error("Failed to commit transaction");
+
+	return stats;
+}
+
+static void remove_database(const fs::path &path) {
+	for (auto suffix: {"", "-wal", "-shm", "-journal"})
+		fs::remove(path.string() + suffix);
+}
+
+/* Rebuild the index from the messages in the store.
+ * Messages are replayed in the order they were received into a new index next to the old one,
+ * which is then copied over the old one in a single transaction.
+ * Hooks are not run, they have already seen these messages when they were imported.
+ */
+Instance::reindex_stats Instance::reindex(unsigned int jobs) {
+	auto start = chrono::steady_clock::now();
+	reindex_stats stats;
+
+	// Received: headers only have a resolution of one second.
+	// If the old index can still be read, use its order to break ties, so bug numbers stay the same.
+	unordered_map<string, int64_t> old_order;
+
+	// The new index is copied into the old one, which only works if their page sizes match.
+	int page_size = 0;
+
+	db.close();
+
+	if (fs::exists(dbfile)) {
+		try {
+			SQLite3::database old(dbfile.string());
+			old.set_busy_timeout(busy_timeout);
+			page_size = old.execute("PRAGMA page_size").get_int(0);
+			// Queued hooks are read while the old index is locked for writing, which only blocks readers without WAL.
+			if (old.execute("PRAGMA journal_mode").get_string(0) != "wal")
+				old.execute("PRAGMA journal_mode=WAL");
+			for (auto &&row: old.execute("SELECT rowid, msgid FROM messages"))
+				old_order[hash_msgid(row.get_string(1))] = row.get_int64(0);
+		} catch (runtime_error &e) {
+			print(cerr, "Could not read the old index, bug numbers might change: {}\n", e.what());
+		}
+	}
+
+	struct entry {
+		string hash;
+		string msgid;
+		string parent;
+		time_t received;
+		int64_t old_rowid;
+	};
+
+	auto hashes = messages->list();
+	vector<entry> entries;
+	entries.reserve(hashes.size());
+	stats.messages = hashes.size();
+
+	for (auto &&hash: hashes) {
+		try {
+			auto view = messages->map(hash);
+			auto received = parse_date(view.get_header("Received"));
+			if (!received)
+				received = parse_date(view.get_header("Date"));
+			auto old = old_order.find(hash);
+			entries.push_back({
+				hash,
+				unquote(string(view.get_header("Message-ID"))),
+				unquote(string(view.get_header("In-Reply-To"))),
+				received,
+				old != old_order.end() ? old->second : INT64_MAX,
+			});
+		} catch (runtime_error &e) {
+			print(cerr, "Could not read stored message {}: {}\n", hash, e.what());
+			stats.failed++;
+		}
+	}
+
+	stable_sort(entries.begin(), entries.end(), [](const entry &a, const entry &b) {
+		return a.received != b.received ? a.received < b.received : a.old_rowid < b.old_rowid;
+	});
+
+	// Replies must come after the messages they refer to, even if the clocks disagree.
+	unordered_set<string> present;
+	for (auto &&e: entries)
+		present.insert(e.msgid);
+
+	unordered_set<string> done;
+	unordered_map<string, vector<size_t>> waiting;
+	vector<bool> emitted(entries.size());
+	vector<string> ordered;
+	ordered.reserve(entries.size());
+
+	auto emit = [&](size_t i) {
+		vector<size_t> todo{i};
+		while (!todo.empty()) {
+			auto j = todo.back();
+			todo.pop_back();
+			if (emitted[j])
+				continue;
+			emitted[j] = true;
+			ordered.push_back(entries[j].hash);
+			done.insert(entries[j].msgid);
+
+			auto it = waiting.find(entries[j].msgid);
+			if (it != waiting.end()) {
+				todo.insert(todo.end(), it->second.rbegin(), it->second.rend());
+				waiting.erase(it);
+			}
+		}
+	};
+
+	for (size_t i = 0; i < entries.size(); i++) {
+		auto &&parent = entries[i].parent;
+		if (!parent.empty() && parent != entries[i].msgid && present.count(parent) && !done.count(parent))
+			waiting[parent].push_back(i);
+		else
+			emit(i);
+	}
+
+	// Replies that refer to each other in a loop are indexed in their original order.
+	vector<size_t> leftover;
+	for (auto &&it: waiting)
+		leftover.insert(leftover.end(), it.second.begin(), it.second.end());
+	sort(leftover.begin(), leftover.end());
+	for (auto i: leftover)
+		emit(i);
+
+	entries.clear();
+
+	// Build the new index
+	auto shadow = fs::path(dbfile.string() + ".new");
+	remove_database(shadow);
+
+	try {
+		if (page_size) {
+			SQLite3::database create(shadow.string());
+			create.execute(format("PRAGMA page_size={}", page_size));
+			create.execute("PRAGMA journal_mode=WAL");
+		}
+
+		init_index(shadow);
+
+		// The new index is useless until it is complete, so there is no need to wait for the disk.
+		db.execute("PRAGMA synchronous=OFF");
+
+		size_t batch_size = BulkImport::default_batch_size;
+		auto batch_size_config = config.get("import", "batch-size");
+		if (!batch_size_config.empty())
+			batch_size = stoul(batch_size_config);
+
+		BulkImport bulk(*this, batch_size);
+		bulk.set_hooks(false);
+		stats.failed += bulk.add_from_store(ordered, jobs);
+		bulk.flush();
+
+		/* Take the write lock on the old index before looking for messages that were stored
+		 * while the new index was being built, and hold it until the new index has been copied over it.
+		 * Other processes store messages before they index them, and they cannot index or queue hooks in the meantime,
+		 * so nothing that was committed to the old index is lost.
+		 * SQLite cannot copy into a file that is not a usable database,
+		 * no other process can be writing to that, so it is simply replaced.
+		 */
+		SQLite3::database live(dbfile.string());
+		live.set_busy_timeout(busy_timeout);
+		SQLite3::database source(shadow.string());
+		std::unique_ptr<SQLite3::backup> copy;
+
+		auto unusable = [](const SQLite3::error &e) {
+			return e.code == SQLITE_NOTADB || e.code == SQLITE_CORRUPT;
+		};
+
+		try {
+			copy = make_unique<SQLite3::backup>(live.begin_copy_from(source));
+		} catch (SQLite3::error &e) {
+			if (!unusable(e))
+				throw;
+			print(cerr, "Could not update the old index ({}), replacing it instead\n", e.what());
+		}
+
+		set<string> seen(hashes.begin(), hashes.end());
+		vector<string> added;
+		for (auto &&hash: messages->list())
+			if (!seen.count(hash))
+				added.push_back(hash);
+		stats.messages += added.size();
+		stats.failed += bulk.add_from_store(added, jobs);
+		bulk.flush();
+
+		// Hooks that were queued but not run yet should survive the rebuild.
+		if (copy) {
+			try {
+				SQLite3::database old(dbfile.string());
+				if (old.execute("PRAGMA user_version").get_int(0) >= 6)
+					for (auto &&row: old.execute("SELECT hook, msgid, attempts FROM hook_queue ORDER BY id"))
+						// Bug numbers might have changed, so look them up again.
+						db.execute("INSERT INTO hook_queue (hook, msgid, bug, attempts) SELECT ?, msgid, bug, ? FROM messages WHERE msgid=?",
+						           row.get_string(0), row.get_int(2), row.get_string(1));
+			} catch (runtime_error &e) {
+				print(cerr, "Could not read queued hooks from the old index: {}\n", e.what());
+			}
+		}
+
+		auto &&bulk_stats = bulk.get_statistics();
+		stats.indexed = bulk_stats.imported;
+		stats.rejected = bulk_stats.rejected;
+		stats.duplicates = bulk_stats.duplicates;
+		stats.failed += bulk_stats.failed;
+
+		db.close();
+
+		// Swap it in
+		if (copy) {
+			copy->finish();
+		} else {
+			live.close();
+			source.close();
+			remove_database(dbfile);
+			fs::rename(shadow, dbfile);
+		}
+	} catch (...) {
+		db.close();
+		remove_database(shadow);
+		throw;
+	}
+
+	db.close();
+	remove_database(shadow);
+	init_index(dbfile);
+
+	stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	return stats;
+}
+
+/* Check the message store and the index against each other.
+ * Every stored message is read back and its hash recomputed, on multiple threads.
+ * Problems are printed to stderr as they are found.
+ * Repairs only ever remove things: index rows that refer to messages or bugs that do not exist,
+ * and stored messages that are not indexed.
+ */
+Instance::fsck_stats Instance::fsck(bool repair, unsigned int jobs, const std::function<void(size_t done, size_t total)> &progress) {
+	fsck_stats stats;
+
+	for (auto &&row: db.execute("PRAGMA quick_check")) {
+		if (row.get_string(0) == "ok")
+			break;
+		print(cerr, "Index is damaged: {}\n", row.get_string(0));
+		stats.index_errors++;
+	}
+
+	// Hashes of all indexed messages
+	unordered_map<string, string> indexed;
+	for (auto &&row: db.execute("SELECT msgid FROM messages")) {
+		auto msgid = row.get_string(0);
+		try {
+			indexed[hash_msgid(msgid)] = msgid;
+		} catch (runtime_error &e) {
+			print(cerr, "Invalid Message-ID {} in the index\n", msgid);
+			stats.index_errors++;
+		}
+	}
+	stats.indexed = indexed.size();
+
+	// Read back every stored message and check that it is stored under the hash of its Message-ID
+	auto hashes = messages->list();
+	stats.stored = hashes.size();
+
+	if (!jobs)
+		jobs = max(1u, thread::hardware_concurrency());
+
+	vector<string> errors(hashes.size());
+	atomic<size_t> next{0};
+	size_t done = 0;
+	mutex lock;
+	condition_variable finished;
+
+	auto worker = [&]() {
+		size_t i, count = 0;
+
+		while ((i = next++) < hashes.size()) {
+			try {
+				auto view = messages->map(hashes[i]);
+				auto msgid = string(view.get_header("Message-ID"));
+				if (msgid.empty())
+					errors[i] = "has no Message-ID";
+				else if (hash_msgid(msgid) != hashes[i])
+					errors[i] = format("has Message-ID {}, which does not match its hash", msgid);
+			} catch (runtime_error &e) {
+				errors[i] = format("could not be read: {}", e.what());
+			}
+
+			// Don't contend for the lock on every message
+			if (++count == 256) {
+				lock_guard<mutex> guard(lock);
+				done += count;
+				count = 0;
+			}
+		}
+
+		lock_guard<mutex> guard(lock);
+		done += count;
+		finished.notify_all();
+	};
+
+	vector<thread> workers;
+	for (unsigned int i = 0; i < min<size_t>(jobs, hashes.size()); i++)
+		workers.emplace_back(worker);
+
+	{
+		unique_lock<mutex> guard(lock);
+		while (!finished.wait_for(guard, chrono::milliseconds(100), [&]{ return done == hashes.size(); }))
+			if (progress)
+				progress(done, hashes.size());
+	}
+
+	for (auto &&thread: workers)
+		thread.join();
+
+	if (progress)
+		progress(hashes.size(), hashes.size());
+
+	unordered_set<string> stored;
+	stored.reserve(hashes.size());
+
+	for (size_t i = 0; i < hashes.size(); i++) {
+		stored.insert(hashes[i]);
+
+		if (!errors[i].empty()) {
+			print(cerr, "Stored message {} {}\n", hashes[i], errors[i]);
+			stats.corrupt++;
+		} else if (!indexed.count(hashes[i])) {
+			print(cerr, "Stored message {} is not indexed\n", hashes[i]);
+			stats.orphans++;
+		}
+	}
+
+	errors.clear();
+
+	auto tx = db.begin();
+
+	for (auto &&it: indexed) {
+		if (stored.count(it.first))
+			continue;
+
+		print(cerr, "Message {} is missing from the message store\n", it.second);
+		stats.missing++;
+
+		if (repair) {
+			db.execute("DELETE FROM messages WHERE msgid=?", it.second);
+			stats.repaired++;
+		}
+	}
+
+	// Bugs need at least one message, everything else needs an existing bug
+	for (auto &&row: db.execute("SELECT id FROM bugs WHERE id NOT IN (SELECT bug FROM messages)")) {
+		print(cerr, "Bug {} has no messages\n", row.get_int64(0));
+		stats.dangling++;
+	}
+
+	for (auto &&row: db.execute("SELECT msgid, bug FROM messages WHERE bug NOT IN (SELECT id FROM bugs)")) {
+		print(cerr, "Message {} belongs to non-existing bug {}, use lbts reindex to fix this\n", row.get_string(0), row.get_int64(1));
+		stats.dangling++;
+	}
+
+	for (auto &&table: {"tags", "versions", "recipients"}) {
+		for (auto &&row: db.execute(format("SELECT bug FROM {} WHERE bug NOT IN (SELECT id FROM bugs)", table))) {
+			print(cerr, "Entry in {} refers to non-existing bug {}\n", table, row.get_int64(0));
+			stats.dangling++;
+		}
+	}
+
+	for (auto &&row: db.execute("SELECT a, b FROM links WHERE a NOT IN (SELECT id FROM bugs) OR b NOT IN (SELECT id FROM bugs)")) {
+		print(cerr, "Link between {} and {} refers to a non-existing bug\n", row.get_int64(0), row.get_int64(1));
+		stats.dangling++;
+	}
+
+	if (repair) {
+		db.execute("DELETE FROM bugs WHERE id NOT IN (SELECT bug FROM messages)");
+		stats.repaired += db.changes();
+
+		for (auto &&table: {"tags", "versions", "recipients"}) {
+			db.execute(format("DELETE FROM {} WHERE bug NOT IN (SELECT id FROM bugs)", table));
+			stats.repaired += db.changes();
+		}
+
+		db.execute("DELETE FROM links WHERE a NOT IN (SELECT id FROM bugs) OR b NOT IN (SELECT id FROM bugs)");
+		stats.repaired += db.changes();
+	}
+
+	if (!tx.commit())
+		throw runtime_error("Failed to commit transaction");
+
+	// Compaction drops everything that is not indexed
+	if (repair && stats.orphans) {
+		compact();
+		stats.repaired += stats.orphans;
+	}
+
+	return stats;
 }
 
 set<string> Instance::get_tags(const Ticket &ticket) {
@@ -424,27 +1454,53 @@ string Instance::get_milestone(const Ticket &ticket) {
 vector<string> Instance::get_message_ids(const Ticket &ticket) {
 	vector<string> result;
 
-	for (auto &&row: db.execute("SELECT msgid FROM messages WHERE bug=?", stol(ticket.id)))
+	for (auto &&row: db.execute("SELECT msgid FROM messages WHERE bug=? ORDER BY id", stol(ticket.id)))
 		result.push_back(row.get_string(0));
 
 	return result;
 }
 
-string Instance::get_first_message_id(const Ticket &ticket) {
-	return db.execute("SELECT msgid FROM messages WHERE bug=? LIMIT 1", stol(ticket.id)).get_string(0);
+/* The messages of a ticket, in the order they were indexed,
+ * or if threaded is true, with each message directly followed by its replies.
+ */
+vector<MessageSummary> Instance::get_message_summaries(const Ticket &ticket, bool threaded) {
+	vector<MessageSummary> result;
+
+	auto sql = threaded
+		? "SELECT msgid, sender, recipient, subject, parent, date, snippet, length, depth, date_text FROM messages WHERE bug=? ORDER BY thread"
+		: "SELECT msgid, sender, recipient, subject, parent, date, snippet, length, depth, date_text FROM messages WHERE bug=? ORDER BY id";
+
+	for (auto &&row: db.execute(sql, stol(ticket.id))) {
+		MessageSummary summary;
+		summary.msgid = row.get_string(0);
+		summary.depth = row.get_int(8);
+		summary.cached = row.get_type(6) != SQLITE_NULL;
+		if (summary.cached) {
+			summary.from = row.get_string(1);
+			summary.to = row.get_string(2);
+			summary.subject = row.get_string(3);
+			summary.parent = row.get_string(4);
+			summary.date = row.get_int64(5);
+			summary.date_text = row.get_string(9);
+			summary.snippet = row.get_string(6);
+			summary.complete = int64_t(summary.snippet.size()) == row.get_int64(7);
+		}
+		result.push_back(std::move(summary));
+	}
+
+	return result;
 }
 
-bool Instance::run_hook(const string &name, const fs::path &path, const string &id) {
-	if (no_hooks)
-		return true;
+string Instance::get_first_message_id(const Ticket &ticket) {
+	return db.execute("SELECT msgid FROM messages WHERE bug=? ORDER BY id LIMIT 1", stol(ticket.id)).get_string(0);
+}
 
+bool Instance::execute_hook(const string &name, const string &env) {
+	Profile::Timer timer("hooks");
 	fs::path hook = hookdir / name;
-	if (access(hook.string().c_str(), X_OK))
-		return true;
 
-	// TODO:
-	fs::current_path(base_dir);
-	string cmd = format("LIGHTBTS_DIR=\"{}\" MESSAGE_FILE=\"{}\" BUG_ID=\"{}\" \"{}\"", base_dir, path, id, hook);
+	// Run the hook from the data directory, without changing our own working directory.
+	string cmd = format("cd \"{0}\" && LIGHTBTS_DIR=\"{0}\" {1} \"{2}\"", base_dir, env, hook);
 	FILE *fd = popen(cmd.c_str(), "w");
 	if (!fd) {
 		print(cerr, "Failed to execute {} hook: {}\n", name, strerror(errno));
@@ -459,166 +1515,532 @@ bool Instance::run_hook(const string &name, const fs::path &path, const string &
 	return true;
 }
 
-void Instance::parse_versions(const string &id, const string &str, int status) {
-	vector<string> versions;
-	split(versions, str, boost::is_any_of(", "), boost::token_compress_on);
-	for (auto version: versions)
-		db.execute("INSERT OR REPLACE INTO versions (bug, version, status) VALUES (?, ?, ?)", id, version, status);
+bool Instance::call_persistent_hook(const string &name, const vector<pair<fs::path, string>> &batch) {
+	Profile::Timer timer("hooks");
+	auto &process = hook_processes[name];
+	if (!process)
+		process = make_unique<HookProcess>(hookdir / name, base_dir, hook_timeout);
+
+	return process->call(name, batch);
 }
 
-void Instance::parse_tags(const string &id, const string &str) {
-	vector<string> tags;
-	split(tags, str, boost::is_any_of(", "), boost::token_compress_on);
-	bool add = true;
-	for (auto tag: tags) {
-		if (tag.empty())
-			continue;
-		if (tag[0] == '-') {
-			add = false;
-			tag.erase(0, 1);
-		} else if (tag[0] == '+') {
-			add = true;
-			tag.erase(0, 1);
-		} else if (tag[0] == '=') {
-			add = true;
-			db.execute("DELETE FROM tags WHERE bug=?", id);
-			tag.erase(0, 1);
-		}
-		if (tag.empty())
-			continue;
-		to_lower(tag);
-		if (add)
-			db.execute("INSERT INTO tags (bug, tag) VALUES (?,?)", id, tag);
+void Instance::queue_hook(const string &name, const string &msgid, const string &id) {
+	if (!has_hook(name))
+		return;
+
+	db.execute("INSERT INTO hook_queue (hook, msgid, bug) VALUES (?, ?, ?)", name, msgid, id);
+}
+
+/* Run the hooks in the queue, on up to jobs threads.
+ * Hooks for the same bug are run one at a time, in the order they were queued.
+ * A hook that fails is retried later, with the delay doubling after each attempt.
+ */
+Instance::hook_queue_stats Instance::run_hook_queue(unsigned int jobs) {
+	hook_queue_stats stats;
+
+	if (!jobs)
+		jobs = max(1u, thread::hardware_concurrency());
+
+	auto tmpdir = base_dir / "tmp";
+	fs::create_directories(tmpdir);
+	auto lock_path = tmpdir / "hook-queue.lock";
+	int lock_fd = open(lock_path.string().c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+	if (lock_fd == -1)
+		throw runtime_error(format("Could not open {}: {}", lock_path.string(), strerror(errno)));
+
+	// Only one process drains the queue, so hooks for a bug never run concurrently.
+	if (flock(lock_fd, LOCK_EX | LOCK_NB)) {
+		close(lock_fd);
+		print(cerr, "The hook queue is already being processed by another process\n");
+		stats.pending = db.execute("SELECT COUNT(*) FROM hook_queue").get_int64(0);
+		return stats;
+	}
+
+	struct entry {
+		int64_t id;
+		string hook;
+		string bug;
+		int attempts;
+		fs::path path;
+		bool ok;
+	};
+
+	while (!no_hooks) {
+		auto now = time(nullptr);
+		vector<entry> ready;
+		unordered_set<string> busy;
+
+		for (auto &&row: db.execute("SELECT id, hook, msgid, bug, attempts, next_attempt FROM hook_queue ORDER BY id")) {
+			auto bug = row.get_string(3);
+			if (!busy.insert(bug).second || row.get_int64(5) > now)
+				continue;
+
+			auto hook = row.get_string(1);
+			entry e{row.get_int64(0), hook, bug, row.get_int(4), {}, false};
+
+			// Hooks that have been removed since the event was queued are ignored, just like when running them directly.
+			if (has_hook(hook)) {
+				try {
+					e.path = messages->get_file(hash_msgid(row.get_string(2)));
+				} catch (runtime_error &err) {
+					print(cerr, "Could not get message {} for {} hook: {}\n", row.get_string(2), hook, err.what());
+					e.attempts = max_hook_attempts;
+				}
+			} else {
+				e.ok = true;
+			}
+
+			ready.push_back(e);
+		}
+
+		if (ready.empty())
+			break;
+
+		// Persistent hooks can only handle one event at a time, the others run in parallel.
+		vector<size_t> parallel;
+		for (size_t i = 0; i < ready.size(); i++)
+			if (!ready[i].path.empty() && !persistent_hooks.count(ready[i].hook))
+				parallel.push_back(i);
+
+		atomic<size_t> next{0};
+		auto worker = [&] {
+			for (size_t i; (i = next++) < parallel.size();) {
+				auto &e = ready[parallel[i]];
+				e.ok = execute_hook(e.hook, format("MESSAGE_FILE=\"{}\" BUG_ID=\"{}\"", e.path, e.bug));
+			}
+		};
+
+		vector<thread> threads;
+		for (unsigned int i = 0; i < min<size_t>(jobs, parallel.size()); i++)
+			threads.emplace_back(worker);
+
+		for (auto &&e: ready) {
+			if (e.path.empty() || !persistent_hooks.count(e.hook))
+				continue;
+			try {
+				e.ok = call_persistent_hook(e.hook, {{e.path, e.bug}});
+			} catch (runtime_error &err) {
+				print(cerr, "{}\n", err.what());
+			}
+		}
+
+		for (auto &&t: threads)
+			t.join();
+
+		for (auto &&e: ready)
+			if (!e.path.empty())
+				messages->release_file(e.path);
+
+		auto tx = db.begin();
+
+		for (auto &&e: ready) {
+			if (e.ok) {
+				db.execute("DELETE FROM hook_queue WHERE id=?", e.id);
+				stats.ran++;
+			} else if (++e.attempts >= int(max_hook_attempts)) {
+				print(cerr, "Giving up on {} hook for bug {} after {} attempts\n", e.hook, e.bug, e.attempts);
+				db.execute("DELETE FROM hook_queue WHERE id=?", e.id);
+				stats.given_up++;
+			} else {
+				int64_t delay = int64_t(hook_retry_delay) << min(e.attempts - 1, 16);
+				db.execute("UPDATE hook_queue SET attempts=?, next_attempt=? WHERE id=?", e.attempts, int64_t(now) + delay, e.id);
+				stats.failed++;
+			}
+		}
+
+		if (!tx.commit())
+			throw runtime_error("Failed to commit transaction");
+	}
+
+	stats.pending = db.execute("SELECT COUNT(*) FROM hook_queue").get_int64(0);
+
+	close(lock_fd);
+	return stats;
+}
+
+bool Instance::has_hook(const string &name) {
+	if (no_hooks)
+		return false;
+
+	fs::path hook = hookdir / name;
+	return !access(hook.string().c_str(), X_OK);
+}
+
+bool Instance::run_hook(const string &name, const string &hash, const string &id) {
+	if (!has_hook(name))
+		return true;
+
+	fs::path path = messages->get_file(hash);
+	bool result;
+
+	try {
+		if (persistent_hooks.count(name))
+			result = call_persistent_hook(name, {{path, id}});
 		else
-			db.execute("DELETE FROM tags WHERE bug=? AND tag=?", id, tag);
+			result = execute_hook(name, format("MESSAGE_FILE=\"{}\" BUG_ID=\"{}\"", path, id));
+	} catch (...) {
+		messages->release_file(path);
+		throw;
 	}
+
+	messages->release_file(path);
+
+	return result;
 }
 
-void Instance::parse_metadata(const string &id, const Message &msg) {
-	// Metadata variables to extract
-	string status;
-	string severity;
-	string title;
-	vector<string> tags;
-	vector<string> versions;
-	vector<string> found;
-	vector<string> notfound;
-	vector<string> fixed;
-	vector<string> notfixed;
-	string owner;
-	string progress;
-	string milestone;
-	string deadline;
+bool Instance::run_batch_hook(const string &name, const vector<pair<string, string>> &batch) {
+	if (!has_hook(name))
+		return true;
 
-	// Warnings and error messages
-	string log;
+	if (persistent_hooks.count(name)) {
+		vector<pair<fs::path, string>> files;
+		bool result;
+
+		try {
+			for (auto &&entry: batch)
+				files.emplace_back(messages->get_file(entry.first), entry.second);
+			result = call_persistent_hook(name, files);
+		} catch (...) {
+			for (auto &&file: files)
+				messages->release_file(file.first);
+			throw;
+		}
 
-	// Parse email headers
-	status = msg["X-LightBTS-Status"];
+		for (auto &&file: files)
+			messages->release_file(file.first);
 
-	{
-		string tag = msg["X-LightBTS-Tag"];
-		if (!tag.empty())
-			tags.push_back(tag);
+		return result;
+	}
+
+	auto tmpdir = base_dir / "tmp";
+	fs::create_directories(tmpdir);
+	auto batch_file = tmpdir / fs::unique_path("batch-%%%%-%%%%-%%%%");
+
+	vector<fs::path> paths;
+	bool result = false;
+
+	try {
+		ofstream out(batch_file.string());
+		for (auto &&entry: batch) {
+			paths.push_back(messages->get_file(entry.first));
+			print(out, "{} {}\n", paths.back().string(), entry.second);
+		}
+		out.close();
+		if (out.fail())
+			throw runtime_error("Could not write batch file");
+
+		result = execute_hook(name, format("BATCH_FILE=\"{}\"", batch_file));
+	} catch (...) {
+		for (auto &&path: paths)
+			messages->release_file(path);
+		fs::remove(batch_file);
+		throw;
+	}
+
+	for (auto &&path: paths)
+		messages->release_file(path);
+	fs::remove(batch_file);
+
+	return result;
+}
+
+/* Pseudo-header fields at the start of a message body.
+ * Keys are looked up with a perfect hash over their length and first and last two characters,
+ * the table is built and checked for collisions at compile time.
+ */
+enum class Field {
+	UNKNOWN,
+	STATUS,
+	SEVERITY,
+	TAGS,
+	VERSION,
+	FOUND,
+	NOTFOUND,
+	FIXED,
+	NOTFIXED,
+	OWNER,
+	PROGRESS,
+	MILESTONE,
+	DEADLINE,
+	TITLE,
+};
+
+static constexpr struct {
+	std::string_view name;
+	Field field;
+} fields[] = {
+	{"status", Field::STATUS},
+	{"severity", Field::SEVERITY},
+	{"tags", Field::TAGS},
+	{"tag", Field::TAGS},
+	{"version", Field::VERSION},
+	{"found", Field::FOUND},
+	{"notfound", Field::NOTFOUND},
+	{"fixed", Field::FIXED},
+	{"notfixed", Field::NOTFIXED},
+	{"owner", Field::OWNER},
+	{"progress", Field::PROGRESS},
+	{"milestone", Field::MILESTONE},
+	{"deadline", Field::DEADLINE},
+	{"title", Field::TITLE},
+	{"topic", Field::TITLE},
+};
+
+static const size_t field_count = sizeof fields / sizeof *fields;
+static const size_t max_field_length = 9;
+
+// Case-insensitive for letters, other characters never match anyway.
+static constexpr size_t field_hash(std::string_view key) {
+	return (key.size() * 2 + (key[0] | 0x20) * 31 + (key[key.size() - 2] | 0x20) + (key[key.size() - 1] | 0x20)) % 32;
+}
+
+static constexpr struct field_table {
+	int8_t slots[32];
+
+	constexpr field_table(): slots() {
+		for (auto &slot: slots)
+			slot = -1;
+
+		for (size_t i = 0; i < field_count; i++) {
+			auto &slot = slots[field_hash(fields[i].name)];
+			if (slot != -1)
+				throw logic_error("Collision in the field hash table");
+			slot = i;
+		}
 	}
+} field_lookup;
+
+static Field lookup_field(std::string_view key) {
+	if (key.size() < 2 || key.size() > max_field_length)
+		return Field::UNKNOWN;
 
-	// Parse the body as if it is a MIME part.
-	stringstream body(msg.get_text());
-	string line;
+	auto slot = field_lookup.slots[field_hash(key)];
+	if (slot < 0 || key.size() != fields[slot].name.size() || strncasecmp(key.data(), fields[slot].name.data(), key.size()))
+		return Field::UNKNOWN;
 
-	auto set_and_check = [&log](const string &name, string &variable, const string &value) {
+	return fields[slot].field;
+}
+
+// Call a function for each word in a list separated by commas and/or spaces.
+template<typename F>
+static void for_each_word(std::string_view str, F f) {
+	while (!str.empty()) {
+		auto start = str.find_first_not_of(", ");
+		if (start == str.npos)
+			break;
+		str.remove_prefix(start);
+		auto end = min(str.find_first_of(", "), str.size());
+		f(str.substr(0, end));
+		str.remove_prefix(end);
+	}
+}
+
+/* Metadata found in a message.
+ * All string_views point into the message text and headers.
+ */
+struct Metadata {
+	std::string_view status;
+	std::string_view severity;
+	std::string_view title;
+	std::string_view owner;
+	std::string_view progress;
+	std::string_view milestone;
+	std::string_view deadline;
+	vector<std::string_view> tags;
+	vector<std::string_view> versions;
+	vector<std::string_view> found;
+	vector<std::string_view> notfound;
+	vector<std::string_view> fixed;
+	vector<std::string_view> notfixed;
+
+	// Warnings and error messages
+	string log;
+
+	void set_and_check(const char *name, std::string_view &variable, std::string_view value) {
 		if (!variable.empty() && value != variable)
-			log += "Duplicate " + name + " field.\n";
+			log += format("Duplicate {} field.\n", name);
 		variable = value;
-	};
+	}
 
-	while (getline(body, line)) {
-		if (line.empty())
-			break;
+	// Parse the pseudo-header at the start of the body, in a single pass without copying.
+	void parse(std::string_view body) {
+		while (!body.empty()) {
+			auto eol = min(body.find('\n'), body.size());
+			auto line = body.substr(0, eol);
+			body.remove_prefix(min(eol + 1, body.size()));
 
-		auto colon = line.find(':');
-		if (colon == line.npos || colon == 0)
-			break;
+			if (line.empty())
+				break;
 
-		if (line.size() <= colon + 2)
-			break;
+			auto colon = line.find(':');
+			if (colon == line.npos || colon == 0)
+				break;
 
-		auto key = to_lower_copy(line.substr(0, colon));
-		auto value = line.substr(colon + 2);
-
-		if (key == "status") {
-			set_and_check("status", status, value);
-		} else if (key == "severity") {
-			set_and_check("severity", severity, value);
-		} else if (key == "tags" || key == "tag") {
-			tags.push_back(value);
-		} else if (key == "version") {
-			versions.push_back(value);
-		} else if(key == "found") {
-			found.push_back(value);
-		} else if(key == "notfound") {
-			notfound.push_back(value);
-		} else if(key == "fixed") {
-			fixed.push_back(value);
-		} else if(key == "notfixed") {
-			notfixed.push_back(value);
-		} else if(key == "owner") {
-			set_and_check("owner", owner, value);
-		} else if(key == "progress") {
-			set_and_check("progress", progress, value);
-		} else if(key == "milestone") {
-			set_and_check("milestone", milestone, value);
-		} else if(key == "deadline") {
-			set_and_check("deadline", deadline, value);
-		} else if(key == "title" || key == "topic") {
-			set_and_check("title", title, value);
-		} else {
-			log += "Unknown header field \"" + key + "\".\n";
+			if (line.size() <= colon + 2)
+				break;
+
+			auto key = line.substr(0, colon);
+			auto value = line.substr(colon + 2);
+
+			switch (lookup_field(key)) {
+			case Field::STATUS: set_and_check("status", status, value); break;
+			case Field::SEVERITY: set_and_check("severity", severity, value); break;
+			case Field::TAGS: tags.push_back(value); break;
+			case Field::VERSION: versions.push_back(value); break;
+			case Field::FOUND: found.push_back(value); break;
+			case Field::NOTFOUND: notfound.push_back(value); break;
+			case Field::FIXED: fixed.push_back(value); break;
+			case Field::NOTFIXED: notfixed.push_back(value); break;
+			case Field::OWNER: set_and_check("owner", owner, value); break;
+			case Field::PROGRESS: set_and_check("progress", progress, value); break;
+			case Field::MILESTONE: set_and_check("milestone", milestone, value); break;
+			case Field::DEADLINE: set_and_check("deadline", deadline, value); break;
+			case Field::TITLE: set_and_check("title", title, value); break;
+			default: log += format("Unknown header field \"{}\".\n", to_lower_copy(string(key))); break;
+			}
 		}
 	}
+};
 
-	// Set any variables found
-	if (!status.empty()) {
-		to_lower(status);
-		db.execute("UPDATE bugs SET status=? WHERE id=?", status_index(status), id);
-	}
+// Execute a statement with a list of rows, in batches to stay below SQLite's limit on the number of variables.
+template<typename T, typename F>
+static void execute_rows(SQLite3::database &db, const string &prefix, const string &row, const string &suffix, const vector<T> &items, F bind) {
+	static const size_t batch_size = 100;
+
+	for (size_t start = 0; start < items.size(); start += batch_size) {
+		auto end = min(start + batch_size, items.size());
+
+		string sql = prefix;
+		for (size_t i = start; i < end; i++) {
+			if (i != start)
+				sql += ", ";
+			sql += row;
+		}
+		sql += suffix;
 
-	if (!severity.empty()) {
-		to_lower(severity);
-		db.execute("UPDATE bugs SET severity=? WHERE id=?", severity_index(severity), id);
+		auto stmt = db.prepare(sql);
+		for (size_t i = start; i < end; i++)
+			bind(stmt, items[i]);
+		if (stmt.step() != SQLITE_DONE)
+			throw db.last_error();
 	}
+}
 
-	if (!owner.empty())
-		db.execute("UPDATE bugs SET owner=? WHERE id=?", owner, id);
+void Instance::parse_metadata(const string &id, const Message &msg) {
+	Profile::Timer timer("parse_metadata");
+	// Keep the strings the metadata points into alive
+	string header_status = msg["X-LightBTS-Status"];
+	string header_tag = msg["X-LightBTS-Tag"];
+	string text = msg.get_text();
+
+	Metadata meta;
+	meta.status = header_status;
+	if (!header_tag.empty())
+		meta.tags.push_back(header_tag);
+	meta.parse(text);
+
+	// Update all fields of the bug itself at once
+	string set;
+	auto add_column = [&set](const char *column) {
+		set += set.empty() ? " SET " : ", ";
+		set += column;
+		set += "=?";
+	};
 
-	if (!progress.empty())
-		db.execute("UPDATE bugs SET progress=? WHERE id=?", progress, id);
+	int status = -1;
+	int severity = -1;
 
-	if (!milestone.empty())
-		db.execute("UPDATE bugs SET milestone=? WHERE id=?", milestone, id);
+	if (!meta.status.empty()) {
+		status = status_index(to_lower_copy(string(meta.status)));
+		add_column("status");
+	}
 
-	if (!deadline.empty())
-		db.execute("UPDATE bugs SET deadline=? WHERE id=?", deadline, id);
+	if (!meta.severity.empty()) {
+		severity = severity_index(to_lower_copy(string(meta.severity)));
+		add_column("severity");
+	}
 
-	if (!title.empty())
-		db.execute("UPDATE bugs SET title=? WHERE id=?", title, id);
+	const pair<const char *, std::string_view> text_columns[] = {
+		{"owner", meta.owner},
+		{"progress", meta.progress},
+		{"milestone", meta.milestone},
+		{"deadline", meta.deadline},
+		{"title", meta.title},
+	};
 
-	for (auto &&tag: tags)
-		parse_tags(id, tag);
+	for (auto &&column: text_columns)
+		if (!column.second.empty())
+			add_column(column.first);
+
+	if (!set.empty()) {
+		auto stmt = db.prepare("UPDATE bugs" + set + " WHERE id=?");
+		if (status != -1)
+			stmt.bind(status);
+		if (severity != -1)
+			stmt.bind(severity);
+		for (auto &&column: text_columns)
+			if (!column.second.empty())
+				stmt.bind(string(column.second));
+		stmt.bind(id);
+		if (stmt.step() != SQLITE_DONE)
+			throw db.last_error();
+	}
+
+	// Work out the resulting changes to the tags, the last change to a tag wins.
+	bool clear_tags = false;
+	map<string, bool> tag_changes;
+
+	for (auto &&tags: meta.tags) {
+		bool add = true;
+		for_each_word(tags, [&](std::string_view tag) {
+			if (tag[0] == '-') {
+				add = false;
+				tag.remove_prefix(1);
+			} else if (tag[0] == '+') {
+				add = true;
+				tag.remove_prefix(1);
+			} else if (tag[0] == '=') {
+				add = true;
+				clear_tags = true;
+				tag_changes.clear();
+				tag.remove_prefix(1);
+			}
+			if (!tag.empty())
+				tag_changes[to_lower_copy(string(tag))] = add;
+		});
+	}
 
-	for (auto &&version: fixed)
-		parse_versions(id, version, 0);
+	vector<string> added_tags;
+	vector<string> removed_tags;
+	for (auto &&change: tag_changes)
+		(change.second ? added_tags : removed_tags).push_back(change.first);
 
-	for (auto &&version: versions) {
-		int status = db.execute("SELECT status FROM bugs WHERE id=?", id);
-		parse_versions(id, version, status);
+	if (clear_tags) {
+		db.execute("DELETE FROM tags WHERE bug=?", id);
+		removed_tags.clear();
 	}
 
-	for (auto &&version: found)
-		parse_versions(id, version, 1);
+	auto bind_tag = [&](SQLite3::statement &stmt, const string &tag) {
+		stmt.bind(id, tag);
+	};
+
+	execute_rows(db, "DELETE FROM tags WHERE (bug, tag) IN (VALUES ", "(?, ?)", ")", removed_tags, bind_tag);
+	execute_rows(db, "INSERT OR IGNORE INTO tags (bug, tag) VALUES ", "(?, ?)", "", added_tags, bind_tag);
+
+	// Fixed versions are applied first, then plain versions, then found versions.
+	// Plain versions are marked as found.
+	map<string, int> version_status;
+	for (auto &&[list, status]: {pair{&meta.fixed, 0}, pair{&meta.versions, 1}, pair{&meta.found, 1}})
+		for (auto &&versions: *list)
+			for_each_word(versions, [&, status = status](std::string_view version) { version_status[string(version)] = status; });
+
+	vector<pair<string, int>> version_rows(version_status.begin(), version_status.end());
+	execute_rows(db, "INSERT OR REPLACE INTO versions (bug, version, status) VALUES ", "(?, ?, ?)", "", version_rows, [&](SQLite3::statement &stmt, const pair<string, int> &row) {
+		stmt.bind(id, row.first, row.second);
+	});
 }
 
-bool Instance::import(const Message &in) {
+Message Instance::prepare(const Message &in) {
 	// Don't allow messages with the X-LightBTS-Control header set
 	if (!in["X-LightBTS-Control"].empty())
 		throw runtime_error("Denying import of message with X-LightBTS-Control header");
@@ -636,26 +2058,27 @@ bool Instance::import(const Message &in) {
 	if (msg["Date"].empty())
 		msg.set_date();
 
-	// Save message
-	string msgid = unquote(msg["Message-ID"]);
+	return msg;
+}
+
+string Instance::index(const Message &msg, bool &is_new) {
+	Profile::Timer timer("index");
+	string msgid = get_msgid(msg);
 	string parent = unquote(msg["In-Reply-To"]);
 	string subject = msg["Subject"];
-	fs::path filename = store(msg);
 
-	// Run the pre-index hook
-	if (!run_hook("pre-index", filename))
-		return false;
+	string text = msg.get_text();
 
-	auto tx = db.begin();
-
-	// Store the message in the database
+	// Store the message in the database, with the headers and snippet lbts show needs
+	int64_t message_id;
 	try {
-		db.execute("INSERT INTO messages (msgid, bug) VALUES (?, ?)", msgid, 0);
+		db.execute("INSERT INTO messages (msgid, bug, date, date_text, sender, recipient, subject, parent, snippet, length) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?)", msgid, 0, int64_t(parse_date(msg["Date"])), msg["Date"], msg["From"], msg["To"], subject, parent, make_snippet(text), int64_t(text.size()));
+		message_id = db.last_insert_rowid();
 	} catch (SQLite3::error &err) {
 		// Ignore duplicates
-		if (err.code == SQLITE_CONSTRAINT_PRIMARYKEY) {
+		if (err.code == SQLITE_CONSTRAINT_UNIQUE) {
 			print(cerr, "Ignoring duplicate message from {} with Message-ID {}\n", msg["From"], msgid);
-			return false;
+			return {};
 		} else {
 			throw runtime_error(format("Database error: {}", err.what()));
 		}
@@ -663,12 +2086,17 @@ bool Instance::import(const Message &in) {
 
 	// Can we match the message to an existing bug?
 	string id;
-	bool is_new = false;
+	int depth = 0;
+	string thread = thread_key(message_id);
+	is_new = false;
 
-	if (!parent.empty()) {
-		auto result = db.execute("SELECT bug FROM messages WHERE msgid=?", parent);
-		if (result)
+	if (!parent.empty() && parent != msgid) {
+		auto result = db.execute("SELECT bug, depth, thread FROM messages WHERE msgid=?", parent);
+		if (result) {
 			id = result.get_string(0);
+			depth = result.get_int(1) + 1;
+			thread = result.get_string(2) + thread;
+		}
 	}
 
 #if 0
@@ -689,7 +2117,7 @@ bool Instance::import(const Message &in) {
 		is_new = true;
 	}
 
-	db.execute("UPDATE messages SET bug=? WHERE msgid=?", id, msgid);
+	db.execute("UPDATE messages SET bug=?, depth=?, thread=? WHERE msgid=?", id, depth, thread, msgid);
 	if (!db.changes())
 		throw runtime_error("Could not update message in index");
 	db.execute("INSERT OR IGNORE INTO recipients (bug, address) VALUES (?, ?)", id, msg["From"]);
@@ -697,11 +2125,48 @@ bool Instance::import(const Message &in) {
 	// Handle metadata
 	parse_metadata(id, msg);
 
+	add_search_text(message_id, subject, text);
+
+	return id;
+}
+
+bool Instance::import(const Message &in) {
+	Profile::Timer timer("import");
+	Message msg = prepare(in);
+
+	// Don't store the message or run any hooks for duplicates
+	if (is_duplicate(msg)) {
+		print(cerr, "Ignoring duplicate message from {} with Message-ID {}\n", msg["From"], get_msgid(msg));
+		return false;
+	}
+
+	// Save message
+	string hash = store(msg);
+
+	// Run the pre-index hook
+	if (!run_hook("pre-index", hash))
+		return false;
+
+	auto tx = db.begin();
+
+	// A compaction that ran since the message was stored did not find it in the index, and dropped it.
+	if (!messages->exists(hash))
+		store(msg);
+
+	bool is_new;
+	string id = index(msg, is_new);
+	if (id.empty())
+		return false;
+
+	if (queue_hooks)
+		queue_hook("post-index", get_msgid(msg), id);
+
 	if(!tx.commit())
 		throw runtime_error("Failed to commit transaction");
 
 	//Run the post-index hook
-	run_hook("post-index", filename, id);
+	if (!queue_hooks)
+		run_hook("post-index", hash, id);
 	return is_new;
 }
 
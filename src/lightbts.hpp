@@ -7,13 +7,21 @@
 */
 
 #include <boost/filesystem.hpp>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
 #include <mimesis.hpp>
 #include <set>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 
 #include "config.hpp"
 #include "sqlite3.hpp"
+#include "store.hpp"
 
 namespace LightBTS {
 
@@ -23,6 +31,12 @@ using std::string;
 using std::vector;
 namespace fs = boost::filesystem;
 
+class HookProcess;
+
+namespace Mustache {
+class Template;
+}
+
 enum class Status {
 	CLOSED,
 	OPEN,
@@ -90,6 +104,8 @@ int severity_index(const string &name);
 bool is_valid_link_type(const string &name);
 int link_type_index(const string &name);
 
+string make_snippet(std::string_view text);
+
 class Ticket {
 	friend class Instance;
 
@@ -110,8 +126,77 @@ class Ticket {
 	string get_status_name() const { return status_names[static_cast<int>(status)]; }
 };
 
+/* Options for a paginated list of tickets.
+ * Pages are continued with a keyset token, so later pages are as fast as the first one,
+ * and tickets added or changed in the meantime do not shift the pages around.
+ */
+struct ListQuery {
+	enum class Order {
+		ID,        // ascending ticket number
+		SEVERITY,  // most severe first, then ascending ticket number
+	};
+
+	Order order = Order::ID;
+	size_t limit = 0;  // maximum number of tickets to return, 0 for no limit
+	string after;      // continuation token returned by the previous page
+};
+
+/* The headers and the start of the text of a message, as cached in the index.
+ * Messages indexed by an old version of LightBTS might not be cached,
+ * in which case only the msgid is set.
+ */
+struct MessageSummary {
+	string msgid;
+	string from;
+	string to;
+	string subject;
+	string parent;          // the Message-ID in In-Reply-To
+	string date_text;       // the Date header as it appears in the message
+	time_t date = 0;        // from the Date header, 0 if it could not be parsed
+	string snippet;         // the first lines of the text
+	bool complete = false;  // whether the snippet is the whole text
+	bool cached = false;
+	int depth = 0;          // the number of ancestors in the reply thread
+};
+
+/* Produces the tickets of a list query one by one, while they are read from the index. */
+class TicketCursor {
+	SQLite3::statement stmt;
+	ListQuery::Order order;
+	size_t limit;
+	size_t count = 0;
+	bool more = false;
+	Ticket ticket{{}, {}, Status::OPEN, Severity::NORMAL};
+
+	public:
+	TicketCursor(SQLite3::statement &&stmt, const ListQuery &query): stmt(std::move(stmt)), order(query.order), limit(query.limit) {}
+
+	/* Advance to the next ticket, returns false at the end of the page. */
+	bool next();
+	const Ticket &get() const { return ticket; }
+
+	/* After the end of the page, the token to pass in ListQuery::after to get the next page.
+	 * It is empty if there are no more tickets.
+	 */
+	string get_continuation() const;
+
+	class iterator {
+		TicketCursor *cursor;
+
+		public:
+		iterator(TicketCursor *cursor = nullptr): cursor(cursor) {}
+		iterator &operator++() { if (!cursor->next()) cursor = nullptr; return *this; }
+		bool operator!=(const iterator &other) const { return cursor != other.cursor; }
+		const Ticket &operator*() const { return cursor->get(); }
+	};
+
+	iterator begin() { return next() ? iterator(this) : iterator(); }
+	iterator end() { return iterator(); }
+};
 
 class Instance {
+	friend class BulkImport;
+
 	fs::path base_dir;
 
 	fs::path dbfile;
@@ -127,50 +212,134 @@ class Instance {
 	string webroot;
 	string staticroot;
 
-	bool quiet;
-	bool no_hooks;
-	bool no_email;
+	bool read_only = false;
+	bool quiet = false;
+	bool no_hooks = false;
+	bool no_email = false;
 	bool respond_to_new;
 	bool respond_to_reply;
+	int busy_timeout;
+	bool sql_statistics = false;
+	uint64_t profiled_misses = 0;    // statement counts already added to the profile
+	uint64_t profiled_executed = 0;
+	std::ostream *sql_log = nullptr;
+	std::unique_ptr<std::ofstream> sql_log_file;
+	int64_t config_mtime = 0;
+	uint64_t index_inode = 0;
+	struct template_state {
+		int64_t mtime = 0;
+		off_t size = -1;     // -1 if the template is not in the template directory
+		bool builtin = true;
+		std::shared_ptr<const Mustache::Template> compiled;
+	};
+	std::map<string, template_state> template_states;
+	bool queue_hooks;
+	unsigned int max_hook_attempts;
+	unsigned int hook_retry_delay;
+	std::chrono::seconds hook_timeout;
 
 	SQLite3::database db;
 	Config config;
+	std::unique_ptr<MessageStore> messages;
+	set<string> persistent_hooks;
+	std::map<string, std::unique_ptr<HookProcess>> hook_processes;
 
-	void init(const fs::path &path, bool create = false);
+	void init(const fs::path &path, bool create = false, bool open_index = true);
+	void init_tracing();
 	void init_index(const fs::path &path);
-
-	fs::path store(const Message &msg);
-
-	bool run_hook(const string &name, const fs::path &path, const string &id = {});
-	void parse_versions(const string &id, const string &str, int status);
-	void parse_tags(const string &id, const string &str);
+	template_state &check_template(const string &name);
+	void add_search_text(int64_t id, const string &title, const string &text);
+
+	static string get_msgid(const Message &msg);
+	bool is_duplicate(const Message &msg);
+	string store(const Message &msg);
+
+	bool has_hook(const string &name);
+	bool execute_hook(const string &name, const string &env);
+	void queue_hook(const string &name, const string &msgid, const string &id);
+	bool call_persistent_hook(const string &name, const vector<std::pair<fs::path, string>> &batch);
+	bool run_hook(const string &name, const string &hash, const string &id = {});
+	bool run_batch_hook(const string &name, const vector<std::pair<string, string>> &batch);
 	void parse_metadata(const string &id, const Message &msg);
 
+	Message prepare(const Message &msg);
+	string index(const Message &msg, bool &is_new);
+
 	public:
 	enum Flags {
 		NONE = 0,
 		INIT = 1 << 0,
+		NO_INDEX = 1 << 1,  // do not open the index, for example because it is going to be rebuilt
+		READ_ONLY = 1 << 2,  // open the index read-only, it must already be up to date
+	};
+
+	struct reindex_stats {
+		size_t messages = 0;
+		size_t indexed = 0;
+		size_t failed = 0;
+		size_t rejected = 0;
+		size_t duplicates = 0;  // superseded copies of messages in the store
+		double seconds = 0;
+	};
+
+	struct fsck_stats {
+		size_t indexed = 0;       // messages in the index
+		size_t stored = 0;        // messages in the message store
+		size_t missing = 0;       // indexed, but not in the message store
+		size_t orphans = 0;       // in the message store, but not indexed
+		size_t corrupt = 0;       // unreadable, or not stored under the hash of their Message-ID
+		size_t dangling = 0;      // rows referring to bugs or messages that do not exist
+		size_t index_errors = 0;  // problems found by SQLite itself
+		size_t repaired = 0;
+
+		size_t problems() const { return missing + orphans + corrupt + dangling + index_errors; }
+	};
+
+	struct hook_queue_stats {
+		size_t ran = 0;
+		size_t failed = 0;    // failed, and will be tried again later
+		size_t given_up = 0;  // failed too many times, and removed from the queue
+		size_t pending = 0;   // still in the queue
 	};
 
 	Instance(const string &path, Flags flags = NONE);
 	~Instance();
 
+	static fs::path find(const fs::path &start_dir = {});
+	bool is_stale();
+	void profile_statements();
+	void skip_profiled_statements();
+
 	string get_config(const string &section, const string &variable);
 	void set_config(const string &section, const string &variable, const string &value);
 	void save_config();
+	string get_template(const string &name);
+	bool is_builtin_template(const string &name);
+	std::shared_ptr<const Mustache::Template> get_compiled_template(const string &name);
+	void set_no_hooks(bool value) { no_hooks = value; }
 	string get_local_email_address();
 	vector<Ticket> list(const vector<string> &args = {}, size_t len = 0);
+	TicketCursor list_cursor(const vector<string> &args = {}, size_t len = 0, const ListQuery &query = {});
+	vector<std::pair<string, size_t>> count_tags(const vector<string> &args = {}, size_t len = 0);
+	vector<std::pair<string, size_t>> count_milestones(const vector<string> &args = {}, size_t len = 0);
+	vector<Ticket> search(const string &query, const vector<string> &args = {}, size_t len = 0);
 	Ticket get_ticket_from_ticket_id(const string &id);
 	Ticket get_ticket_from_message_id(const string &id);
 	Ticket get_ticket(const string &id);
 	Message get_message(const string &id);
+	MessageView get_message_view(const string &id);
 
 	set<string> get_tags(const Ticket &ticket);
 	string get_milestone(const Ticket &ticket);
 	vector<string> get_message_ids(const Ticket &ticket);
+	vector<MessageSummary> get_message_summaries(const Ticket &ticket, bool threaded = false);
 	string get_first_message_id(const Ticket &ticket);
 
 	bool import(const Message &msg);
+	MessageStore::compact_stats compact();
+	reindex_stats reindex(unsigned int jobs = 0);
+	fsck_stats fsck(bool repair = false, unsigned int jobs = 0, const std::function<void(size_t done, size_t total)> &progress = {});
+	hook_queue_stats run_hook_queue(unsigned int jobs = 0);
 };
 
 }
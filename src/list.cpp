@@ -4,8 +4,8 @@
    SPDX-License-Identifier: GPL-3.0+
 */
 
-#include <set>
 #include <fmt/ostream.h>
+#include <iostream>
 
 #include "list.hpp"
 
@@ -17,12 +17,10 @@ using namespace std;
 using namespace fmt;
 
 int do_list(const char *argv0, const vector<string> &args) {
-	LightBTS::Instance bts(data_dir);
+	auto &bts = open_instance();
 
 	bool do_tags = false;
 	bool do_milestones = false;
-	set<string> tags;
-	set<string> milestones;
 	auto len = args.size();
 
 	if (!args.empty()) {
@@ -39,26 +37,45 @@ int do_list(const char *argv0, const vector<string> &args) {
 		}
 	}
 
+	LightBTS::ListQuery query;
+	query.limit = limit;
+	query.after = after;
+
+	if (order == "severity") {
+		query.order = LightBTS::ListQuery::Order::SEVERITY;
+	} else if (!order.empty() && order != "id") {
+		print(cerr, "Invalid sort order {}\n", order);
+		return 1;
+	}
+
 	Pager pager(bts.get_config("core", "pager"));
 
-	for(auto &&ticket: bts.list(args, len)) {
-		if (do_tags) {
-			for(auto &&tag: bts.get_tags(ticket))
-				tags.insert(tag);
-		} else if (do_milestones) {
-			milestones.insert(bts.get_milestone(ticket));
-		} else {
-			print(pager, "{:>6} {:6} {:9}  {}\n", ticket.get_id(), ticket.get_status_name(), ticket.get_severity_name(), ticket.get_title());
+	if (do_tags || do_milestones) {
+		auto counts = do_tags ? bts.count_tags(args, len) : bts.count_milestones(args, len);
+
+		for (auto &&count: counts) {
+			if (verbose)
+				print(pager, "{:>6} {}\n", count.second, count.first);
+			else
+				print(pager, "{}\n", count.first);
 		}
+
+		return 0;
 	}
 
-	if (do_tags) {
-		for (auto &&tag: tags)
-			print(pager, "{}\n", tag);
-	} else if (do_milestones) {
-		for (auto &&milestone: milestones)
-			print(pager, "{}\n", milestone);
+	// Tickets are printed while they are read from the index
+	try {
+		auto cursor = bts.list_cursor(args, len, query);
+		for(auto &&ticket: cursor)
+			print(pager, "{:>6} {:6} {:9}  {}\n", ticket.get_id(), ticket.get_status_name(), ticket.get_severity_name(), ticket.get_title());
+
+		auto continuation = cursor.get_continuation();
+		if (!continuation.empty())
+			print(cerr, "More bugs follow, continue with --after={}\n", continuation);
+	} catch (runtime_error &e) {
+		print(cerr, "{}\n", e.what());
+		return 1;
 	}
 
 	return 0;
-}	
+}
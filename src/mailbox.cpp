@@ -0,0 +1,138 @@
+/* LightBTS -- a lightweight issue tracking system
+   Copyright © 2018 Guus Sliepen <guus@lightbts.info>
+
+   SPDX-License-Identifier: GPL-3.0+
+*/
+
+#include <algorithm>
+#include <limits>
+
+#include "mailbox.hpp"
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+namespace LightBTS {
+
+MboxReader::MboxReader(istream &in, uint64_t offset): in(in), position(offset) {
+	if (!offset)
+		return;
+
+	// Seek if possible, otherwise skip the given number of bytes.
+	if (!in.seekg(offset, ios::beg)) {
+		in.clear();
+		while (offset && in) {
+			auto chunk = min<uint64_t>(offset, numeric_limits<streamsize>::max());
+			in.ignore(chunk);
+			offset -= in.gcount();
+		}
+	}
+}
+
+void MboxReader::unread(const string &line) {
+	pending = line;
+	has_pending = true;
+	position += line.size() + 1;
+}
+
+bool MboxReader::read_line(string &line) {
+	if (has_pending) {
+		line.swap(pending);
+		has_pending = false;
+		return true;
+	}
+
+	if (!getline(in, line))
+		return false;
+
+	position += line.size() + (in.eof() ? 0 : 1);
+	return true;
+}
+
+bool MboxReader::next(string &message, uint64_t &start) {
+	string line;
+	message.clear();
+
+	// Find the start of the next message.
+	while (true) {
+		start = get_offset();
+		if (!read_line(line))
+			return false;
+		if (is_separator(line))
+			break;
+	}
+
+	size_t blank_lines = 0;
+
+	while (read_line(line)) {
+		if (line.empty() || line == "\r") {
+			blank_lines++;
+			continue;
+		}
+
+		// The blank line before a separator belongs to the mbox format, not to the message.
+		if (blank_lines && is_separator(line)) {
+			blank_lines--;
+			pending.swap(line);
+			has_pending = true;
+			break;
+		}
+
+		for (; blank_lines; blank_lines--)
+			message.append("\n");
+
+		auto quotes = line.find_first_not_of('>');
+		if (quotes && quotes != line.npos && !line.compare(quotes, 5, "From "))
+			line.erase(0, 1);
+
+		message.append(line);
+		message.push_back('\n');
+	}
+
+	if (!has_pending && blank_lines)
+		blank_lines--;
+
+	for (; blank_lines; blank_lines--)
+		message.append("\n");
+
+	return true;
+}
+
+bool is_maildir(const fs::path &dir) {
+	return fs::is_directory(dir / "cur") && fs::is_directory(dir / "new");
+}
+
+static void list_maildir_folder(const fs::path &dir, vector<fs::path> &files) {
+	for (auto &&subdir: {"cur", "new"}) {
+		for (auto &&file: fs::directory_iterator(dir / subdir)) {
+			if (file.path().filename().string()[0] == '.')
+				continue;
+			if (fs::is_regular_file(file.path()))
+				files.push_back(file.path());
+		}
+	}
+}
+
+vector<string> list_maildir(const fs::path &dir) {
+	vector<fs::path> files;
+
+	list_maildir_folder(dir, files);
+
+	for (auto &&subdir: fs::directory_iterator(dir)) {
+		auto name = subdir.path().filename().string();
+		if (name.size() > 1 && name[0] == '.' && name != ".." && is_maildir(subdir.path()))
+			list_maildir_folder(subdir.path(), files);
+	}
+
+	sort(files.begin(), files.end(), [](const fs::path &a, const fs::path &b) {
+		return a.filename() < b.filename();
+	});
+
+	vector<string> result;
+	for (auto &&file: files)
+		result.push_back(file.string());
+
+	return result;
+}
+
+}
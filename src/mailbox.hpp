@@ -0,0 +1,53 @@
+#pragma once
+
+/* LightBTS -- a lightweight issue tracking system
+   Copyright © 2018 Guus Sliepen <guus@lightbts.info>
+
+   SPDX-License-Identifier: GPL-3.0+
+*/
+
+#include <boost/filesystem.hpp>
+#include <cstdint>
+#include <istream>
+#include <string>
+#include <vector>
+
+namespace LightBTS {
+
+namespace fs = boost::filesystem;
+
+/* Splits an mbox file into separate messages, reading only one message at a time.
+ * Lines starting with one or more '>' followed by "From " are unescaped (mboxrd).
+ * Offsets are byte offsets into the stream, and can be used to resume reading.
+ */
+class MboxReader {
+	std::istream &in;
+	uint64_t position;
+	std::string pending;
+	bool has_pending = false;
+
+	bool read_line(std::string &line);
+
+	public:
+	MboxReader(std::istream &in, uint64_t offset = 0);
+
+	/* Push back a line that has already been read from the stream before it was passed to the reader. */
+	void unread(const std::string &line);
+
+	/* Get the next message, returns false at the end of the stream. */
+	bool next(std::string &message, uint64_t &start);
+
+	/* The offset of the next message that will be returned. */
+	uint64_t get_offset() const { return has_pending ? position - pending.size() - 1 : position; }
+
+	static bool is_separator(const std::string &line) { return !line.compare(0, 5, "From "); }
+};
+
+/* Returns the message files in a Maildir, including its Maildir++ subfolders,
+ * sorted by their names, which start with the time of delivery.
+ */
+std::vector<std::string> list_maildir(const fs::path &dir);
+
+bool is_maildir(const fs::path &dir);
+
+}
@@ -0,0 +1,248 @@
+/* LightBTS -- a lightweight issue tracking system
+   Copyright © 2018 Guus Sliepen <guus@lightbts.info>
+
+   SPDX-License-Identifier: GPL-3.0+
+*/
+
+#include <limits>
+#include <stdexcept>
+#include <fmt/format.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "mustache.hpp"
+#include "writer.hpp"
+
+using namespace std;
+using namespace fmt;
+
+namespace LightBTS {
+
+namespace Mustache {
+
+static std::string_view trim(std::string_view str) {
+	while (!str.empty() && isspace((unsigned char)str.front()))
+		str.remove_prefix(1);
+	while (!str.empty() && isspace((unsigned char)str.back()))
+		str.remove_suffix(1);
+	return str;
+}
+
+vector<Token> tokenize(std::string_view tmpl) {
+	vector<Token> tokens;
+	vector<size_t> open;
+
+	while (!tmpl.empty()) {
+		auto start = tmpl.find("{{");
+		if (start)
+			tokens.push_back({Token::Type::TEXT, tmpl.substr(0, start)});
+		if (start == tmpl.npos)
+			break;
+
+		tmpl.remove_prefix(start + 2);
+
+		bool triple = !tmpl.empty() && tmpl.front() == '{';
+		auto end = tmpl.find(triple ? "}}}" : "}}");
+		if (end == tmpl.npos)
+			throw runtime_error("Unterminated tag in template");
+
+		auto tag = tmpl.substr(triple, end - triple);
+		tmpl.remove_prefix(end + (triple ? 3 : 2));
+
+		if (triple) {
+			tokens.push_back({Token::Type::RAW_VALUE, trim(tag)});
+			continue;
+		}
+
+		char sigil = tag.empty() ? 0 : tag.front();
+		auto name = trim(tag.substr(sigil == '&' || sigil == '#' || sigil == '^' || sigil == '/' || sigil == '!'));
+
+		switch (sigil) {
+		case '!':
+			break;
+		case '&':
+			tokens.push_back({Token::Type::RAW_VALUE, name});
+			break;
+		case '#':
+		case '^':
+			open.push_back(tokens.size());
+			tokens.push_back({sigil == '#' ? Token::Type::SECTION : Token::Type::INVERTED, name});
+			break;
+		case '/':
+			if (open.empty() || tokens[open.back()].text != name)
+				throw runtime_error(format("Unexpected end of section {} in template", string(name)));
+			tokens[open.back()].end = tokens.size();
+			open.pop_back();
+			tokens.push_back({Token::Type::END, name});
+			break;
+		default:
+			tokens.push_back({Token::Type::VALUE, name});
+			break;
+		}
+	}
+
+	if (!open.empty())
+		throw runtime_error(format("Unterminated section {} in template", string(tokens[open.back()].text)));
+
+	return tokens;
+}
+
+static bool is_special(char c) {
+	return c == '&' || c == '<' || c == '>' || c == '"' || c == '\'';
+}
+
+/* The first character that needs escaping, or end.
+ * Message bodies make up most of a bug page and rarely contain such characters,
+ * so they are scanned 16 bytes at a time where possible.
+ */
+static const char *find_special(const char *p, const char *end) {
+#ifdef __SSE2__
+	const __m128i amp = _mm_set1_epi8('&');
+	const __m128i lt = _mm_set1_epi8('<');
+	const __m128i gt = _mm_set1_epi8('>');
+	const __m128i quot = _mm_set1_epi8('"');
+	const __m128i apos = _mm_set1_epi8('\'');
+
+	for (; end - p >= 16; p += 16) {
+		auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+		auto match = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, amp), _mm_cmpeq_epi8(chunk, lt)),
+		                          _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, gt), _mm_cmpeq_epi8(chunk, quot)),
+		                                       _mm_cmpeq_epi8(chunk, apos)));
+		if (auto mask = _mm_movemask_epi8(match))
+			return p + __builtin_ctz(mask);
+	}
+#endif
+
+	while (p < end && !is_special(*p))
+		p++;
+
+	return p;
+}
+
+void escape_html(std::string_view text, string &out) {
+	out.reserve(out.size() + text.size());
+
+	auto p = text.data();
+	auto end = p + text.size();
+
+	while (true) {
+		auto special = find_special(p, end);
+		out.append(p, special - p);
+		if (special == end)
+			break;
+
+		switch (*special) {
+		case '&': out += "&amp;"; break;
+		case '<': out += "&lt;"; break;
+		case '>': out += "&gt;"; break;
+		case '"': out += "&quot;"; break;
+		case '\'': out += "&#39;"; break;
+		}
+
+		p = special + 1;
+	}
+}
+
+Template::Template(std::string tmpl): text(move(tmpl)) {
+	if (text.size() > numeric_limits<uint32_t>::max())
+		throw runtime_error("Template is too large");
+
+	auto tokens = tokenize(text);
+	instructions.reserve(tokens.size());
+
+	for (auto &&tok: tokens)
+		instructions.push_back({tok.type, uint32_t(tok.text.data() - text.data()), uint32_t(tok.text.size()), uint32_t(tok.end)});
+}
+
+// The innermost context is at the back.
+using stack = vector<const Context *>;
+
+static const string *find_value(const stack &contexts, std::string_view name) {
+	for (auto it = contexts.rbegin(); it != contexts.rend(); ++it) {
+		auto value = (*it)->values.find(name);
+		if (value != (*it)->values.end())
+			return &value->second;
+	}
+	return nullptr;
+}
+
+static const vector<Context> *find_list(const stack &contexts, std::string_view name) {
+	for (auto it = contexts.rbegin(); it != contexts.rend(); ++it) {
+		auto list = (*it)->lists.find(name);
+		if (list != (*it)->lists.end())
+			return &list->second;
+	}
+	return nullptr;
+}
+
+void Template::render(size_t begin, size_t end, stack &contexts, Writer &out) const {
+	for (size_t i = begin; i < end; i++) {
+		auto &&ins = instructions[i];
+
+		switch (ins.type) {
+		case Token::Type::TEXT:
+			out.copy(get_text(ins));
+			break;
+
+		case Token::Type::VALUE:
+		case Token::Type::RAW_VALUE:
+			if (auto value = find_value(contexts, get_text(ins))) {
+				if (ins.type == Token::Type::VALUE)
+					out.escape(*value);
+				else
+					out.copy(*value);
+			}
+			break;
+
+		case Token::Type::SECTION:
+		case Token::Type::INVERTED: {
+			auto name = get_text(ins);
+			auto list = find_list(contexts, name);
+			auto value = list ? nullptr : find_value(contexts, name);
+			bool truthy = list ? !list->empty() : value && !value->empty();
+
+			if (ins.type == Token::Type::INVERTED) {
+				if (!truthy)
+					render(i + 1, ins.end, contexts, out);
+			} else if (list) {
+				for (auto &&element: *list) {
+					contexts.push_back(&element);
+					render(i + 1, ins.end, contexts, out);
+					contexts.pop_back();
+				}
+			} else if (truthy) {
+				render(i + 1, ins.end, contexts, out);
+			}
+
+			i = ins.end;
+			break;
+		}
+
+		case Token::Type::END:
+			break;
+		}
+	}
+}
+
+/* The text of the template is copied into the writer's buffer, not referenced,
+ * so the output does not depend on the template staying around.
+ */
+void Template::render(const Context &context, Writer &out) const {
+	stack contexts{&context};
+	render(0, instructions.size(), contexts, out);
+}
+
+string Template::render(const Context &context) const {
+	Writer out;
+	render(context, out);
+	return out.str();
+}
+
+string render(std::string_view tmpl, const Context &context) {
+	return Template(string(tmpl)).render(context);
+}
+
+}
+
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+/* LightBTS -- a lightweight issue tracking system
+   Copyright © 2018 Guus Sliepen <guus@lightbts.info>
+
+   SPDX-License-Identifier: GPL-3.0+
+*/
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace LightBTS {
+
+class Writer;
+
+namespace Mustache {
+
+/* The data a template is rendered with.
+ * A name refers either to a string value or to a list of nested contexts.
+ * Names that are not found in a nested context are looked up in the enclosing ones.
+ */
+struct Context {
+	std::map<std::string, std::string, std::less<>> values;
+	std::map<std::string, std::vector<Context>, std::less<>> lists;
+
+	void set(const std::string &name, std::string value) { values[name] = std::move(value); }
+	std::vector<Context> &list(const std::string &name) { return lists[name]; }
+};
+
+/* A template is split into literal text and tags.
+ * Sections refer to the index of their matching END token, so they can be skipped or repeated.
+ */
+struct Token {
+	enum class Type {
+		TEXT,
+		VALUE,      // {{name}}, HTML-escaped
+		RAW_VALUE,  // {{{name}}} or {{&name}}
+		SECTION,    // {{#name}}
+		INVERTED,   // {{^name}}
+		END,        // {{/name}}
+	};
+
+	Type type;
+	std::string_view text;  // literal text, or the name of a tag
+	size_t end = 0;         // for sections, the index of the matching END token
+};
+
+// Throws a runtime_error if the template is malformed.
+std::vector<Token> tokenize(std::string_view tmpl);
+
+/* A template that is parsed once and can then be rendered any number of times,
+ * using the subset of Mustache the built-in templates use:
+ * {{name}} and {{{name}}} or {{&name}} for escaped and unescaped values,
+ * {{#name}}...{{/name}} and {{^name}}...{{/name}} for sections and inverted sections,
+ * and {{! comments}}.
+ * A section is rendered once for every element of a list,
+ * or once if the name refers to a non-empty value.
+ */
+class Template {
+	struct Instruction {
+		Token::Type type;
+		uint32_t offset;  // of the literal text or the name in text
+		uint32_t size;
+		uint32_t end;     // for sections, the index of the matching END instruction
+	};
+
+	std::string text;
+	std::vector<Instruction> instructions;
+
+	std::string_view get_text(const Instruction &instruction) const {
+		return std::string_view(text).substr(instruction.offset, instruction.size);
+	}
+	void render(size_t begin, size_t end, std::vector<const Context *> &contexts, Writer &out) const;
+
+	public:
+	// Throws a runtime_error if the template is malformed.
+	explicit Template(std::string tmpl);
+
+	void render(const Context &context, Writer &out) const;
+	std::string render(const Context &context) const;
+};
+
+std::string render(std::string_view tmpl, const Context &context);
+
+// Append text to out, with the characters that are special in HTML replaced by entities.
+void escape_html(std::string_view text, std::string &out);
+
+}
+
+}
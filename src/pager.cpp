@@ -7,6 +7,7 @@
 #include "pager.hpp"
 
 #include "cli.hpp"
+#include "profile.hpp"
 
 using namespace std;
 
@@ -30,6 +31,7 @@ Pager::Pager(string cmd) {
 	} else {
 		if (!getenv("LESS"))
 			cmd = "LESS=FRX " + cmd;
+		LightBTS::Profile::Timer timer("pager.start");
 		fd = popen(cmd.c_str(), "w");
 		if (fd)
 			fd_is_popen = true;
@@ -39,6 +41,9 @@ Pager::Pager(string cmd) {
 }
 
 Pager::~Pager() {
-	if (fd_is_popen)
+	if (fd_is_popen) {
+		// This includes the time the user spends reading.
+		LightBTS::Profile::Timer timer("pager.wait");
 		pclose(fd);
+	}
 }
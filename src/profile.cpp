@@ -0,0 +1,83 @@
+/* LightBTS -- a lightweight issue tracking system
+   Copyright © 2018 Guus Sliepen <guus@lightbts.info>
+
+   SPDX-License-Identifier: GPL-3.0+
+*/
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <string>
+#include <fmt/ostream.h>
+
+#include "profile.hpp"
+
+using namespace std;
+using namespace fmt;
+
+namespace LightBTS {
+
+namespace Profile {
+
+bool enabled;
+
+struct phase_stats {
+	uint64_t count = 0;
+	chrono::steady_clock::duration total{};
+	chrono::steady_clock::duration max{};
+};
+
+// Phases can be timed from multiple threads, for example during bulk imports.
+static mutex lock;
+static map<string, phase_stats> phases;
+static uint64_t statements_prepared;
+static uint64_t statements_executed;
+
+void add(const char *phase, chrono::steady_clock::duration duration) {
+	lock_guard<mutex> guard(lock);
+	auto &stats = phases[phase];
+	stats.count++;
+	stats.total += duration;
+	stats.max = std::max(stats.max, duration);
+}
+
+void add_statements(uint64_t prepared, uint64_t executed) {
+	lock_guard<mutex> guard(lock);
+	statements_prepared += prepared;
+	statements_executed += executed;
+}
+
+void reset() {
+	lock_guard<mutex> guard(lock);
+	phases.clear();
+	statements_prepared = 0;
+	statements_executed = 0;
+}
+
+static double ms(chrono::steady_clock::duration duration) {
+	return chrono::duration<double, milli>(duration).count();
+}
+
+void report(ostream &out) {
+	lock_guard<mutex> guard(lock);
+	print(out, "{:<24} {:>8} {:>12} {:>12}\n", "phase", "count", "total ms", "max ms");
+	for (auto &&it: phases)
+		print(out, "{:<24} {:>8} {:>12.3f} {:>12.3f}\n", it.first, it.second.count, ms(it.second.total), ms(it.second.max));
+	print(out, "SQL statements: {} prepared, {} executed\n", statements_prepared, statements_executed);
+}
+
+void report_json(ostream &out) {
+	lock_guard<mutex> guard(lock);
+	print(out, "{{\"phases\": {{");
+	bool first = true;
+	for (auto &&it: phases) {
+		print(out, "{}\"{}\": {{\"count\": {}, \"total_ms\": {:.3f}, \"max_ms\": {:.3f}}}",
+		      first ? "" : ", ", it.first, it.second.count, ms(it.second.total), ms(it.second.max));
+		first = false;
+	}
+	print(out, "}}, \"statements\": {{\"prepared\": {}, \"executed\": {}}}}}\n", statements_prepared, statements_executed);
+}
+
+}
+
+}
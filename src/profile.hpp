@@ -0,0 +1,48 @@
+#pragma once
+
+/* LightBTS -- a lightweight issue tracking system
+   Copyright © 2018 Guus Sliepen <guus@lightbts.info>
+
+   SPDX-License-Identifier: GPL-3.0+
+*/
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+namespace LightBTS {
+
+/* Timing of the phases of a command, enabled with lbts --profile.
+ * When disabled, a Timer only costs a check of a global flag.
+ * Phases can be nested, the time of an inner phase is also counted in the outer one.
+ */
+namespace Profile {
+
+extern bool enabled;
+
+void add(const char *phase, std::chrono::steady_clock::duration duration);
+void add_statements(uint64_t prepared, uint64_t executed);
+void reset();
+void report(std::ostream &out);
+void report_json(std::ostream &out);
+
+class Timer {
+	const char *phase;
+	bool active;
+	std::chrono::steady_clock::time_point start;
+
+	public:
+	Timer(const char *phase): phase(phase), active(enabled) {
+		if (active)
+			start = std::chrono::steady_clock::now();
+	}
+
+	~Timer() {
+		if (active)
+			add(phase, std::chrono::steady_clock::now() - start);
+	}
+};
+
+}
+
+}
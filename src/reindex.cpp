@@ -0,0 +1,36 @@
+/* LightBTS -- a lightweight issue tracking system
+   Copyright © 2018 Guus Sliepen <guus@lightbts.info>
+
+   SPDX-License-Identifier: GPL-3.0+
+*/
+
+#include <fmt/ostream.h>
+#include <iostream>
+
+#include "reindex.hpp"
+
+#include "cli.hpp"
+#include "lightbts.hpp"
+
+using namespace std;
+using namespace fmt;
+
+int do_reindex(const char *argv0, const vector<string> &args) {
+	if (!args.empty()) {
+		print(cerr, "Too many arguments\n");
+		return 1;
+	}
+
+	// The old index might be too old or too broken to open.
+	LightBTS::Instance bts(data_dir, LightBTS::Instance::Flags::NO_INDEX);
+
+	auto stats = bts.reindex(jobs);
+
+	if (verbose) {
+		print(cerr, "Indexed {} of {} messages in {:.3f} seconds ({:.0f} messages/second)\n",
+		      stats.indexed, stats.messages, stats.seconds, stats.seconds > 0 ? stats.messages / stats.seconds : 0.0);
+		print(cerr, "{} rejected, {} duplicates, {} failed\n", stats.rejected, stats.duplicates, stats.failed);
+	}
+
+	return stats.failed ? 1 : 0;
+}
@@ -47,7 +47,7 @@ int do_reply(const char *argv0, const vector<string> &args) {
 		return 1;
 	}
 
-	LightBTS::Instance bts(data_dir);
+	auto &bts = open_instance();
 
 	auto id = args[0];
 	if (id.find('@') == id.npos) {
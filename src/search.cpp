@@ -0,0 +1,78 @@
+/* LightBTS -- a lightweight issue tracking system
+   Copyright © 2018 Guus Sliepen <guus@lightbts.info>
+
+   SPDX-License-Identifier: GPL-3.0+
+*/
+
+#include <fmt/ostream.h>
+#include <iostream>
+
+#include "search.hpp"
+
+#include "cli.hpp"
+#include "lightbts.hpp"
+#include "pager.hpp"
+
+using namespace std;
+using namespace fmt;
+
+/* Turn a search term into an FTS5 string, so punctuation in the term is not parsed as query syntax.
+ * A trailing asterisk is kept outside the quotes to allow prefix searches.
+ */
+static string quote_term(const string &term) {
+	bool prefix = term.size() > 1 && term.back() == '*';
+	string quoted = "\"";
+
+	for (size_t i = 0; i < term.size() - prefix; i++) {
+		if (term[i] == '"')
+			quoted.push_back('"');
+		quoted.push_back(term[i]);
+	}
+
+	quoted.push_back('"');
+
+	if (prefix)
+		quoted.push_back('*');
+
+	return quoted;
+}
+
+int do_search(const char *argv0, const vector<string> &args) {
+	vector<string> filters = tags;
+	string query;
+
+	if (!severity.empty())
+		filters.push_back(severity);
+
+	for (auto &&arg: args) {
+		if (arg == "all" || arg == "open" || arg == "closed" || LightBTS::is_valid_severity(arg)) {
+			filters.push_back(arg);
+		} else if (!arg.empty()) {
+			if (!query.empty())
+				query.push_back(' ');
+			query += quote_term(arg);
+		}
+	}
+
+	if (query.empty()) {
+		print(cerr, "No search terms given\n");
+		return 1;
+	}
+
+	auto &bts = open_instance();
+	vector<LightBTS::Ticket> tickets;
+
+	try {
+		tickets = bts.search(query, filters, filters.size());
+	} catch (SQLite3::error &e) {
+		print(cerr, "Invalid search query: {}\n", e.what());
+		return 1;
+	}
+
+	Pager pager(bts.get_config("core", "pager"));
+
+	for (auto &&ticket: tickets)
+		print(pager, "{:>6} {:6} {:9}  {}\n", ticket.get_id(), ticket.get_status_name(), ticket.get_severity_name(), ticket.get_title());
+
+	return 0;
+}
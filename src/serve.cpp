@@ -0,0 +1,350 @@
+/* LightBTS -- a lightweight issue tracking system
+   Copyright © 2018 Guus Sliepen <guus@lightbts.info>
+
+   SPDX-License-Identifier: GPL-3.0+
+*/
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <stdio_ext.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <fmt/ostream.h>
+
+#include "serve.hpp"
+
+#include "cli.hpp"
+#include "lightbts.hpp"
+
+using namespace std;
+using namespace fmt;
+namespace fs = boost::filesystem;
+
+extern char **environ;
+
+/* A request consists of a header with the length of the rest of the request,
+ * the number of arguments and the number of environment variables,
+ * followed by the working directory, the arguments and the environment variables of the client,
+ * all terminated by a NUL byte.
+ * The client's stdin, stdout and stderr are passed along with the header.
+ * The server answers with the exit code of the command.
+ */
+struct request_header {
+	uint32_t length;
+	uint32_t argc;
+	uint32_t envc;
+};
+
+static fs::path socket_path(const fs::path &base_dir) {
+	return base_dir / "serve.sock";
+}
+
+static bool make_address(const fs::path &path, sockaddr_un &addr) {
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	if (path.string().size() >= sizeof addr.sun_path)
+		return false;
+	strcpy(addr.sun_path, path.string().c_str());
+	return true;
+}
+
+static int connect_to(const fs::path &path) {
+	sockaddr_un addr;
+	if (!make_address(path, addr))
+		return -1;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -1;
+
+	if (connect(fd, (sockaddr *)&addr, sizeof addr)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static bool write_all(int fd, const void *data, size_t size) {
+	auto ptr = static_cast<const char *>(data);
+	while (size) {
+		auto result = write(fd, ptr, size);
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result <= 0)
+			return false;
+		ptr += result;
+		size -= result;
+	}
+	return true;
+}
+
+static bool read_all(int fd, void *data, size_t size) {
+	auto ptr = static_cast<char *>(data);
+	while (size) {
+		auto result = read(fd, ptr, size);
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result <= 0)
+			return false;
+		ptr += result;
+		size -= result;
+	}
+	return true;
+}
+
+bool forward_to_server(int argc, char *argv[], int &result) {
+	fs::path base_dir;
+	try {
+		base_dir = LightBTS::Instance::find(data_dir);
+	} catch (runtime_error &e) {
+		return false;
+	}
+
+	int fd = connect_to(socket_path(base_dir));
+	if (fd == -1)
+		return false;
+
+	string payload = fs::current_path().string();
+	payload.push_back(0);
+	for (int i = 0; i < argc; i++) {
+		payload.append(argv[i]);
+		payload.push_back(0);
+	}
+	uint32_t envc = 0;
+	for (char **env = environ; *env; env++, envc++) {
+		payload.append(*env);
+		payload.push_back(0);
+	}
+
+	request_header header{uint32_t(payload.size()), uint32_t(argc), envc};
+
+	// Send the header together with our stdin, stdout and stderr.
+	int fds[3] = {0, 1, 2};
+	char control[CMSG_SPACE(sizeof fds)] = {};
+	iovec iov{&header, sizeof header};
+	msghdr msg{};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof control;
+	auto cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof fds);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof fds);
+
+	ssize_t sent;
+	while ((sent = sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+		;
+
+	if (sent != sizeof header) {
+		// The server is not working, but it has not done anything yet.
+		close(fd);
+		return false;
+	}
+
+	int32_t exit_code;
+	if (!write_all(fd, payload.data(), payload.size()) || !read_all(fd, &exit_code, sizeof exit_code)) {
+		print(cerr, "Lost connection to lbts serve\n");
+		exit_code = 1;
+	}
+
+	close(fd);
+	result = exit_code;
+	return true;
+}
+
+static fs::path server_socket;
+static char server_socket_c_str[sizeof(sockaddr_un::sun_path)];
+
+static void stop_handler(int) {
+	unlink(server_socket_c_str);
+	_exit(0);
+}
+
+// Run one request, with the client's file descriptors, working directory and environment.
+static void handle_client(int client, const int saved_fds[3], const vector<string> &saved_env) {
+	// Only our own user may run commands as us.
+	ucred cred{};
+	socklen_t cred_len = sizeof cred;
+	if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) || cred.uid != geteuid()) {
+		print(cerr, "Refusing request from user {}\n", cred.uid);
+		return;
+	}
+
+	request_header header;
+	int fds[3] = {-1, -1, -1};
+	char control[CMSG_SPACE(sizeof fds)] = {};
+	iovec iov{&header, sizeof header};
+	msghdr msg{};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof control;
+
+	ssize_t received;
+	while ((received = recvmsg(client, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+		;
+
+	auto cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof fds))
+		memcpy(fds, CMSG_DATA(cmsg), sizeof fds);
+
+	auto close_fds = [&] {
+		for (auto fd: fds)
+			if (fd != -1)
+				close(fd);
+	};
+
+	if (received != sizeof header || fds[0] == -1 || fds[1] == -1 || fds[2] == -1 || header.length > (64 << 20)) {
+		close_fds();
+		return;
+	}
+
+	string payload(header.length, 0);
+	if (!read_all(client, &payload[0], payload.size()) || payload.back()) {
+		close_fds();
+		return;
+	}
+
+	vector<char *> strings;
+	for (size_t pos = 0; pos < payload.size(); pos += strlen(&payload[pos]) + 1)
+		strings.push_back(&payload[pos]);
+
+	if (strings.size() != 1 + header.argc + header.envc || !header.argc) {
+		close_fds();
+		return;
+	}
+
+	int32_t exit_code = 1;
+
+	if (chdir(strings[0])) {
+		print(cerr, "Could not change to directory {}: {}\n", strings[0], strerror(errno));
+	} else {
+		clearenv();
+		for (uint32_t i = 0; i < header.envc; i++)
+			putenv(strings[1 + header.argc + i]);
+
+		for (int i = 0; i < 3; i++)
+			dup2(fds[i], i);
+
+		vector<char *> argv(strings.begin() + 1, strings.begin() + 1 + header.argc);
+		argv.push_back(nullptr);
+
+		try {
+			exit_code = run_command_line(header.argc, argv.data());
+		} catch (exception &e) {
+			print(cerr, "{}: {}\n", argv[0], e.what());
+			// Don't trust the state of an instance that was interrupted by an error.
+			close_instance();
+			exit_code = 1;
+		}
+
+		fflush(stdout);
+		fflush(stderr);
+		cout.flush();
+		cerr.flush();
+
+		// Forget anything left over from the client's stdin.
+		__fpurge(stdin);
+		clearerr(stdin);
+		cin.clear();
+
+		for (int i = 0; i < 3; i++)
+			dup2(saved_fds[i], i);
+
+		clearenv();
+		for (auto &&var: saved_env)
+			putenv(const_cast<char *>(var.c_str()));
+	}
+
+	close_fds();
+	write_all(client, &exit_code, sizeof exit_code);
+}
+
+int do_serve(const char *argv0, const vector<string> &args) {
+	if (!args.empty()) {
+		print(cerr, "Too many arguments\n");
+		return 1;
+	}
+
+	auto base_dir = LightBTS::Instance::find(data_dir);
+	server_socket = socket_path(base_dir);
+
+	sockaddr_un addr;
+	if (!make_address(server_socket, addr)) {
+		print(cerr, "Path to socket {} is too long\n", server_socket.string());
+		return 1;
+	}
+
+	int fd = connect_to(server_socket);
+	if (fd != -1) {
+		close(fd);
+		print(cerr, "Another lbts serve is already running for this instance\n");
+		return 1;
+	}
+
+	// Left behind by a server that did not exit cleanly.
+	unlink(server_socket.string().c_str());
+
+	// The socket is created with mode 0600, there is no moment at which other users can connect to it.
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	auto old_umask = umask(0177);
+	bool bound = listen_fd != -1 && !bind(listen_fd, (sockaddr *)&addr, sizeof addr);
+	umask(old_umask);
+	if (!bound || listen(listen_fd, 16)) {
+		print(cerr, "Could not listen on {}: {}\n", server_socket.string(), strerror(errno));
+		return 1;
+	}
+
+	strcpy(server_socket_c_str, server_socket.string().c_str());
+	signal(SIGINT, stop_handler);
+	signal(SIGTERM, stop_handler);
+	signal(SIGHUP, stop_handler);
+
+	// A client that goes away should not take the server with it.
+	signal(SIGPIPE, SIG_IGN);
+
+	serving = true;
+
+	// Open the instance now, so the first request does not have to wait for it.
+	open_instance();
+
+	int saved_fds[3];
+	for (int i = 0; i < 3; i++)
+		saved_fds[i] = fcntl(i, F_DUPFD_CLOEXEC, 3);
+
+	// The strings must stay alive while they are part of the environment.
+	vector<string> saved_env;
+	for (char **env = environ; *env; env++)
+		saved_env.push_back(*env);
+	string saved_cwd = fs::current_path().string();
+
+	if (verbose)
+		print(cerr, "Serving requests on {}\n", server_socket.string());
+
+	while (true) {
+		int client = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+		if (client == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			print(cerr, "Could not accept connection: {}\n", strerror(errno));
+			break;
+		}
+
+		handle_client(client, saved_fds, saved_env);
+		close(client);
+
+		if (chdir(saved_cwd.c_str()))
+			print(cerr, "Could not change back to directory {}: {}\n", saved_cwd, strerror(errno));
+	}
+
+	unlink(server_socket.string().c_str());
+	return 1;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+/* LightBTS -- a lightweight issue tracking system
+   Copyright © 2018 Guus Sliepen <guus@lightbts.info>
+
+   SPDX-License-Identifier: GPL-3.0+
+*/
+
+#include <string>
+#include <vector>
+
+extern int do_serve(const char *argv0, const std::vector<std::string> &args);
+
+// Run the command line in a running lbts serve, if there is one.
+extern bool forward_to_server(int argc, char *argv[], int &result);
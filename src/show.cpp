@@ -17,6 +17,19 @@
 using namespace std;
 using namespace fmt;
 
+static void write(Pager &pager, std::string_view data) {
+	fwrite(data.data(), 1, data.size(), pager);
+}
+
+// Get the text of a message, only decoding it if it is not plain text already.
+static std::string_view get_text(LightBTS::Instance &bts, const LightBTS::MessageView &message, const string &id, string &decoded) {
+	if (message.is_plain_text())
+		return message.get_body();
+
+	decoded = bts.get_message(id).get_text();
+	return decoded;
+}
+
 static void show_bug_header(LightBTS::Instance &bts, Pager &pager, const LightBTS::Ticket &ticket) {
 	print(pager, "Bug#{}: {}\n", ticket.get_id(), ticket.get_title());
 	print(pager, "Status: {}\n", ticket.get_status_name());
@@ -36,9 +49,9 @@ static void show_bug_header(LightBTS::Instance &bts, Pager &pager, const LightBT
 }
 
 static int do_show_message(const string &id) {
-	LightBTS::Instance bts(data_dir);
+	auto &bts = open_instance();
 
-	auto message = bts.get_message(id);
+	auto message = bts.get_message_view(id);
 
 	Pager pager(bts.get_config("core", "pager"));
 
@@ -47,13 +60,18 @@ static int do_show_message(const string &id) {
 		show_bug_header(bts, pager, ticket);
 	}
 
-	print(pager, "{}", message.to_string());
+	write(pager, message.get_data());
 
 	return 0;
 }
 
+/* The headers and the start of the text of each message come from the index.
+ * With --thread, replies follow the message they reply to, indented by their depth in the thread.
+ * The message itself is only read if its full text is needed,
+ * or if it was indexed before the index cached them.
+ */
 static int do_show_bug(const string &id) {
-	LightBTS::Instance bts(data_dir);
+	auto &bts = open_instance();
 
 	auto ticket = bts.get_ticket(id);
 
@@ -62,35 +80,53 @@ static int do_show_bug(const string &id) {
 	show_bug_header(bts, pager, ticket);
 
 	bool first = true;
-	for (auto &&message_id: bts.get_message_ids(ticket)) {
+	string decoded;
+	for (auto &&summary: bts.get_message_summaries(ticket, threaded)) {
 		if (verbose) {
 			if (!first)
 				print(pager, "\n");
-			auto message = bts.get_message(message_id);
-			print(pager, "From: {}\n", message["From"]);
-			print(pager, "To: {}\n", message["To"]);
-			print(pager, "Subject: {}\n", message["Subject"]);
-			print(pager, "Date: {}\n", message["Date"]);
-			print(pager, "Message-ID: {}\n", message["Message-ID"]);
-			print(pager, "\n");
-			print(pager, "{}", message.get_text());
+			if (summary.cached) {
+				print(pager, "From: {}\n", summary.from);
+				print(pager, "To: {}\n", summary.to);
+				print(pager, "Subject: {}\n", summary.subject);
+				print(pager, "Date: {}\n", summary.date_text);
+				print(pager, "Message-ID: <{}>\n", summary.msgid);
+				if (threaded && summary.depth)
+					print(pager, "In-Reply-To: <{}>\n", summary.parent);
+				print(pager, "\n");
+			}
+			if (summary.complete) {
+				write(pager, summary.snippet);
+			} else {
+				auto message = bts.get_message_view(summary.msgid);
+				if (!summary.cached) {
+					print(pager, "From: {}\n", message.get_header("From"));
+					print(pager, "To: {}\n", message.get_header("To"));
+					print(pager, "Subject: {}\n", message.get_header("Subject"));
+					print(pager, "Date: {}\n", message.get_header("Date"));
+					print(pager, "Message-ID: {}\n", message.get_header("Message-ID"));
+					print(pager, "\n");
+				}
+				write(pager, get_text(bts, message, summary.msgid, decoded));
+			}
 		} else {
 			if (first) {
-				auto message = bts.get_message(message_id);
-				string text = message.get_text();
-				string::size_type pos = 0;
-				for(int i = 0; i < 10 && pos != text.npos; i++) {
-					pos = text.find('\n', pos);
-					if (pos != text.npos)
-						pos++;
+				if (!summary.cached) {
+					auto message = bts.get_message_view(summary.msgid);
+					auto text = get_text(bts, message, summary.msgid, decoded);
+					summary.snippet = LightBTS::make_snippet(text);
+					summary.complete = summary.snippet.size() == text.size();
 				}
-				print(pager, "{}", text.substr(0, pos));
-				if (pos != text.npos)
+				write(pager, summary.snippet);
+				if (!summary.complete)
 					print(pager, "[...]\n");
 				print(pager, "\n");
 			}
 
-			print(pager, "{}\n", message_id);
+			if (threaded)
+				print(pager, "{:{}}{}  {}\n", "", 2 * summary.depth, summary.msgid, summary.from);
+			else
+				print(pager, "{}\n", summary.msgid);
 		}
 
 		first = false;
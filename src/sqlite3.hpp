@@ -6,9 +6,19 @@
    SPDX-License-Identifier: GPL-3.0+
 */
 
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <list>
 #include <sqlite3.h>
 #include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
+#include <vector>
 
 namespace SQLite3 {
 	struct error: std::runtime_error {
@@ -28,6 +38,96 @@ namespace SQLite3 {
 			throw error(db);
 	}
 
+	static inline ::sqlite3_stmt *prepare(::sqlite3 *db, const std::string &sql) {
+		const char *str = sql.c_str();
+		size_t size = sql.size();
+		const char *tail;
+		::sqlite3_stmt *stmt;
+
+		check(db, sqlite3_prepare_v2(db, str, size + 1, &stmt, &tail));
+
+		if (tail != str + size) {
+			sqlite3_finalize(stmt);
+			throw error("statement was not fully processed");
+		}
+
+		return stmt;
+	}
+
+	/* A least recently used cache of prepared statements, keyed by their SQL text.
+	 * Statements are taken out of the cache while they are in use,
+	 * so the same SQL can be executed multiple times concurrently.
+	 */
+	class statement_cache {
+		struct entry {
+			std::string sql;
+			::sqlite3_stmt *stmt;
+		};
+
+		std::list<entry> lru;
+		std::unordered_map<std::string, std::list<entry>::iterator> index;
+		size_t capacity = 64;
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+
+		public:
+		statement_cache() {}
+		statement_cache(const statement_cache &other) = delete;
+		~statement_cache() { clear(); }
+
+		::sqlite3_stmt *acquire(::sqlite3 *db, const std::string &sql) {
+			auto it = index.find(sql);
+			if (it == index.end()) {
+				misses++;
+				return prepare(db, sql);
+			}
+
+			hits++;
+			auto stmt = it->second->stmt;
+			lru.erase(it->second);
+			index.erase(it);
+			return stmt;
+		}
+
+		void release(const std::string &sql, ::sqlite3_stmt *stmt) {
+			sqlite3_reset(stmt);
+			sqlite3_clear_bindings(stmt);
+
+			if (!capacity || index.count(sql)) {
+				sqlite3_finalize(stmt);
+				return;
+			}
+
+			lru.push_front({sql, stmt});
+			index[sql] = lru.begin();
+
+			if (lru.size() > capacity) {
+				sqlite3_finalize(lru.back().stmt);
+				index.erase(lru.back().sql);
+				lru.pop_back();
+			}
+		}
+
+		void clear() {
+			for (auto &&entry: lru)
+				sqlite3_finalize(entry.stmt);
+			lru.clear();
+			index.clear();
+		}
+
+		void set_capacity(size_t size) {
+			capacity = size;
+			while (lru.size() > capacity) {
+				sqlite3_finalize(lru.back().stmt);
+				index.erase(lru.back().sql);
+				lru.pop_back();
+			}
+		}
+
+		uint64_t get_hits() const { return hits; }
+		uint64_t get_misses() const { return misses; }
+	};
+
 	/* An sqlite3_stmt handle is kind of an overloaded thing in SQLite3.
 	 * It acts as a prepared statement, a filled in statement,
 	 * and a row of results.
@@ -35,6 +135,8 @@ namespace SQLite3 {
 	class statement {
 		friend class result;
 		::sqlite3_stmt *stmt = nullptr;
+		statement_cache *cache = nullptr;
+		std::string sql;
 		int p = 0;
 		int state;
 
@@ -44,25 +146,31 @@ namespace SQLite3 {
 
 		statement(statement &&other) {
 			stmt = other.stmt;
+			cache = other.cache;
+			sql = std::move(other.sql);
 			p = other.p;
+			state = other.state;
 			other.stmt = nullptr;
 		}
 
 		statement(): stmt(nullptr) {}
 
-		statement(::sqlite3 *db, const std::string &sql) {
-			const char *str = sql.c_str();
-			size_t size = sql.size();
-			const char *tail;
-
-			check(db, sqlite3_prepare(db, str, size + 1, &stmt, &tail));
+		statement(::sqlite3 *db, const std::string &sql): stmt(SQLite3::prepare(db, sql)) {}
 
-			if (tail != str + size)
-				throw error("statement was not fully processed");
+		/* A statement that is returned to the cache instead of finalized when done. */
+		statement(::sqlite3 *db, const std::string &sql, statement_cache *cache): cache(cache), sql(sql) {
+			stmt = cache->acquire(db, sql);
 		}
 
 		/* Destructor */
-		~statement() { if(stmt) sqlite3_finalize(stmt); }
+		~statement() {
+			if (!stmt)
+				return;
+			if (cache)
+				cache->release(sql, stmt);
+			else
+				sqlite3_finalize(stmt);
+		}
 
 		/* Binding arguments */
 		statement &bind(const char *arg) { if (arg) check(sqlite3_bind_text(stmt, ++p, arg, -1, SQLITE_TRANSIENT)); else check(sqlite3_bind_null(stmt, ++p)); return *this;  }
@@ -126,13 +234,20 @@ namespace SQLite3 {
 		public:
 		template<typename... Ts>
 		result(::sqlite3 *db, const std::string &sql, Ts... args): stmt(db, sql) {
+			run(db, args...);
+		}
+
+		template<typename... Ts>
+		result(::sqlite3 *db, statement_cache *cache, const std::string &sql, Ts... args): stmt(db, sql, cache) {
+			run(db, args...);
+		}
+
+		template<typename... Ts>
+		void run(::sqlite3 *db, Ts... args) {
 			stmt.bind(args...);
 			auto status = stmt.step();
-			if (status != SQLITE_DONE && status != SQLITE_ROW) {
-				sqlite3_finalize(stmt.stmt);
-				stmt.stmt = nullptr;
+			if (status != SQLITE_DONE && status != SQLITE_ROW)
 				throw error(db);
-			}
 		}
 
 		result(result &other) = delete;
@@ -155,8 +270,36 @@ namespace SQLite3 {
 		int column_count() { return stmt.column_count(); }
 	};
 
+	/* Step a statement that needs a lock another connection might hold.
+	 * SQLite's busy handler already waits for most locks,
+	 * but in some cases SQLITE_BUSY is returned immediately,
+	 * for example when the WAL file is being recovered by another process.
+	 * Retry those with an exponential backoff until the timeout, in milliseconds, expires.
+	 */
+	static inline int step_with_retry(statement &stmt, int timeout) {
+		int delay = 1;
+		int waited = 0;
+
+		while (true) {
+			int result = stmt.step();
+			if ((result != SQLITE_BUSY && result != SQLITE_LOCKED) || waited >= timeout)
+				return result;
+
+			std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+			waited += delay;
+			delay = std::min(delay * 2, 100);
+		}
+	}
+
+	/* A write transaction.
+	 * It starts with BEGIN IMMEDIATE, so the write lock is taken up front.
+	 * A deferred transaction that has to upgrade its read lock later
+	 * could fail with SQLITE_BUSY without the busy handler ever being called.
+	 */
 	class transaction {
 		::sqlite3 *db;
+		statement_cache *cache;
+		int timeout = 0;
 		bool finished = false;
 
 		public:
@@ -164,11 +307,18 @@ namespace SQLite3 {
 
 		transaction(transaction &&other) {
 			db = other.db;
+			cache = other.cache;
+			timeout = other.timeout;
+			finished = other.finished;
 			other.finished = true;
 		}
 
-		transaction(::sqlite3 *db): db(db) {
-			statement(db, "BEGIN").step();
+		transaction(::sqlite3 *db, statement_cache *cache, int timeout = 0): db(db), cache(cache), timeout(timeout) {
+			statement begin(db, "BEGIN IMMEDIATE", cache);
+			if (step_with_retry(begin, timeout) != SQLITE_DONE) {
+				finished = true;
+				throw error(db);
+			}
 		}
 
 		~transaction() {
@@ -179,35 +329,155 @@ namespace SQLite3 {
 		bool commit() {
 			if (finished)
 				throw error("Trying to commit to an already finished transaction");
-			if (statement(db, "COMMIT").step() == SQLITE_DONE)
+			statement commit(db, "COMMIT", cache);
+			if (step_with_retry(commit, timeout) == SQLITE_DONE)
 				finished = true;
 			return finished;
 		}
 
 		void abort() {
 			if (!finished) {
-				statement(db, "ROLLBACK").step();
+				statement(db, "ROLLBACK", cache).step();
 				finished = true;
 			}
 		}
 	};
 
+	/* A copy of a whole database into another one, see database::begin_copy_from().
+	 * Creating it only takes the locks, finish() copies all pages.
+	 * The write lock on the destination is held from the start until the copy is finished or abandoned,
+	 * changes made to the source in the meantime are included in the copy.
+	 */
+	class backup {
+		::sqlite3_backup *handle;
+
+		public:
+		backup(const backup &other) = delete;
+
+		backup(backup &&other): handle(other.handle) {
+			other.handle = nullptr;
+		}
+
+		backup(::sqlite3 *dest, ::sqlite3 *source): handle(sqlite3_backup_init(dest, "main", source, "main")) {
+			if (!handle)
+				throw error(dest);
+
+			// Copying zero pages takes the locks, the busy handler is called while waiting for the write lock.
+			int result = sqlite3_backup_step(handle, 0);
+			if (result != SQLITE_OK && result != SQLITE_DONE) {
+				sqlite3_backup_finish(handle);
+				handle = nullptr;
+				throw error(result);
+			}
+		}
+
+		~backup() {
+			if (handle)
+				sqlite3_backup_finish(handle);
+		}
+
+		void finish() {
+			if (!handle)
+				throw error("Trying to finish an already finished backup");
+			int result = sqlite3_backup_step(handle, -1);
+			sqlite3_backup_finish(handle);
+			handle = nullptr;
+			if (result != SQLITE_DONE)
+				throw error(result);
+		}
+	};
+
+	/* Aggregated run times of all executions of one SQL statement. */
+	struct statement_stats {
+		uint64_t count = 0;
+		int64_t total_ns = 0;
+		int64_t max_ns = 0;
+		uint64_t full_scan_steps = 0;
+	};
+
+	/* What to trace, see database::set_tracing(). */
+	struct trace_options {
+		std::function<void(const std::string &message)> log;
+		int64_t slow_ns = -1;        // log statements taking at least this long, if not negative
+		bool explain_scans = false;  // log the query plan of statements that do full table scans
+		bool statistics = false;     // keep statement_stats per SQL text
+	};
+
 	class database {
 		::sqlite3 *db;
+		statement_cache cache;
+		int timeout = 0;
+		uint64_t executed = 0;
+		std::function<void(const char *sql, int64_t ns)> profile_callback;
+		trace_options tracing;
+		std::unordered_map<std::string, statement_stats> stats;
+		std::unordered_set<std::string> explained;
+		std::vector<std::string> to_explain;
+
+		static int trace(unsigned int type, void *context, void *p, void *x) {
+			if (type != SQLITE_TRACE_PROFILE)
+				return 0;
+
+			auto self = static_cast<database *>(context);
+			auto stmt = static_cast<::sqlite3_stmt *>(p);
+			auto ns = *static_cast<int64_t *>(x);
+			auto sql = sqlite3_sql(stmt);
+
+			if (self->profile_callback)
+				self->profile_callback(sql, ns);
+
+			auto &&tracing = self->tracing;
+			if (!tracing.log)
+				return 0;
+
+			// The counter is reset, since cached statements are executed many times.
+			uint64_t scans = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+
+			if (tracing.statistics) {
+				auto &entry = self->stats[sql];
+				entry.count++;
+				entry.total_ns += ns;
+				entry.max_ns = std::max(entry.max_ns, ns);
+				entry.full_scan_steps += scans;
+			}
+
+			if (tracing.slow_ns >= 0 && ns >= tracing.slow_ns) {
+				char *expanded = sqlite3_expanded_sql(stmt);
+				tracing.log("Slow query (" + std::to_string(ns / 1000000.0) + " ms): " + (expanded ? expanded : sql));
+				sqlite3_free(expanded);
+			}
+
+			// Running another statement from inside the trace callback is not allowed, so do it later.
+			if (tracing.explain_scans && scans && self->explained.insert(sql).second)
+				self->to_explain.push_back(sql);
+
+			return 0;
+		}
+
+		void install_trace() {
+			if (!db)
+				return;
+			bool active = profile_callback || tracing.log;
+			check(db, sqlite3_trace_v2(db, active ? SQLITE_TRACE_PROFILE : 0, active ? trace : nullptr, this));
+		}
 
 		public:
 		database(): db(nullptr) {}
 
-		void open(const std::string &filename) {
-			if (sqlite3_open(filename.c_str(), &db))
+		void open(const std::string &filename, bool read_only = false) {
+			int flags = read_only ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+			if (sqlite3_open_v2(filename.c_str(), &db, flags, nullptr))
 				throw error("could not open database");
+			install_trace();
 		}
 
-		database(const std::string &filename) {
+		database(const std::string &filename): db(nullptr) {
 			open(filename);
 		}
 
 		void close() {
+			explain_pending();
+			cache.clear();
 			sqlite3_close(db);
 			db = nullptr;
 		}
@@ -217,16 +487,88 @@ namespace SQLite3 {
 		}
 
 		statement prepare(const std::string &sql) {
-			return statement(db, sql);
+			executed++;
+			return statement(db, sql, &cache);
 		}
 
 		template<typename... Ts>
 		result execute(const std::string &sql, Ts... args) {
-			return result(db, sql, args...);
+			executed++;
+			if (!to_explain.empty())
+				explain_pending();
+			return result(db, &cache, sql, args...);
+		}
+
+		/* Statement cache control and statistics */
+		void set_cache_size(size_t size) { cache.set_capacity(size); }
+		uint64_t cache_hits() const { return cache.get_hits(); }
+		uint64_t cache_misses() const { return cache.get_misses(); }
+		uint64_t statements_executed() const { return executed; }
+
+		/* Call a function with the SQL text and the run time in nanoseconds of every statement that finishes. */
+		void set_profile(std::function<void(const char *sql, int64_t ns)> callback) {
+			profile_callback = std::move(callback);
+			install_trace();
+		}
+
+		/* Trace statements as they finish, sending messages to options.log.
+		 * Tracing stays enabled when the database is closed and opened again.
+		 * An empty log function disables tracing.
+		 */
+		void set_tracing(trace_options options) {
+			tracing = std::move(options);
+			install_trace();
+		}
+
+		const std::unordered_map<std::string, statement_stats> &statement_statistics() const { return stats; }
+
+		/* Log the query plans of statements that were seen doing full table scans. */
+		void explain_pending() {
+			auto pending = std::move(to_explain);
+			to_explain.clear();
+
+			if (!db || !tracing.log)
+				return;
+
+			for (auto &&sql: pending) {
+				std::string plan = "Full table scan: " + sql;
+				try {
+					statement stmt(db, "EXPLAIN QUERY PLAN " + sql);
+					while (stmt.step() == SQLITE_ROW)
+						plan += "\n    " + stmt.column_string(3);
+				} catch (error &e) {
+					plan += "\n    (no query plan: " + std::string(e.what()) + ")";
+				}
+				tracing.log(plan);
+			}
+		}
+
+		/* How long to wait for locks held by other connections, in milliseconds. */
+		void set_busy_timeout(int ms) {
+			timeout = ms;
+			check(db, sqlite3_busy_timeout(db, ms));
 		}
 
 		transaction begin() {
-			return transaction(db);
+			return transaction(db, &cache, timeout);
+		}
+
+		/* Replace the whole contents of this database with those of another one.
+		 * The copy is done in a single transaction,
+		 * so other connections see either the old or the new contents.
+		 */
+		void copy_from(database &source) {
+			begin_copy_from(source).finish();
+		}
+
+		/* Like copy_from(), but the write lock on this database is taken right away,
+		 * so the source can still be changed before the copy is finished,
+		 * while nothing else can write to this database.
+		 * This connection must not be used until then.
+		 */
+		backup begin_copy_from(database &source) {
+			cache.clear();
+			return backup(db, source.db);
 		}
 
 		int64_t last_insert_rowid() {
@@ -240,6 +582,11 @@ namespace SQLite3 {
 		int total_changes() {
 			return sqlite3_total_changes(db);
 		}
+
+		/* An exception describing the most recent error on this connection. */
+		error last_error() {
+			return error(db);
+		}
 	};
 
 	static inline database open(const std::string &filename) {
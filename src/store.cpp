@@ -0,0 +1,835 @@
+/* LightBTS -- a lightweight issue tracking system
+   Copyright © 2018 Guus Sliepen <guus@lightbts.info>
+
+   SPDX-License-Identifier: GPL-3.0+
+*/
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <sstream>
+#include <strings.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#include <fmt/format.h>
+
+#include "store.hpp"
+
+using namespace std;
+using namespace fmt;
+namespace fs = boost::filesystem;
+
+static const char hexdigits[] = "0123456789abcdef";
+
+static string to_hex(const uint8_t *raw, size_t len) {
+	string result(len * 2, '\0');
+
+	for (size_t i = 0; i < len; i++) {
+		result[i * 2] = hexdigits[raw[i] >> 4];
+		result[i * 2 + 1] = hexdigits[raw[i] & 0xf];
+	}
+
+	return result;
+}
+
+static int from_hexdigit(char c) {
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	throw runtime_error("Invalid message hash");
+}
+
+static void from_hex(const string &hex, uint8_t *raw, size_t len) {
+	if (hex.size() != len * 2)
+		throw runtime_error("Invalid message hash");
+
+	for (size_t i = 0; i < len; i++)
+		raw[i] = from_hexdigit(hex[i * 2]) << 4 | from_hexdigit(hex[i * 2 + 1]);
+}
+
+static void write_all(int fd, const void *buf, size_t len) {
+	auto ptr = static_cast<const char *>(buf);
+
+	while (len) {
+		auto result = write(fd, ptr, len);
+		if (result < 0) {
+			if (errno == EINTR)
+				continue;
+			throw runtime_error(format("Could not write to message store: {}", strerror(errno)));
+		}
+		ptr += result;
+		len -= result;
+	}
+}
+
+static void read_all(int fd, void *buf, size_t len, off_t offset) {
+	auto ptr = static_cast<char *>(buf);
+
+	while (len) {
+		auto result = pread(fd, ptr, len, offset);
+		if (result < 0) {
+			if (errno == EINTR)
+				continue;
+			throw runtime_error(format("Could not read from message store: {}", strerror(errno)));
+		}
+		if (result == 0)
+			throw runtime_error("Message store is truncated");
+		ptr += result;
+		len -= result;
+		offset += result;
+	}
+}
+
+// Exclusive lock on a file, released when going out of scope.
+class lock_file {
+	int fd;
+
+	public:
+	lock_file(const fs::path &path) {
+		fd = open(path.string().c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+		if (fd == -1)
+			throw runtime_error(format("Could not open {}: {}", path.string(), strerror(errno)));
+		while (flock(fd, LOCK_EX)) {
+			if (errno != EINTR) {
+				close(fd);
+				throw runtime_error(format("Could not lock {}: {}", path.string(), strerror(errno)));
+			}
+		}
+	}
+
+	~lock_file() {
+		close(fd);
+	}
+};
+
+static bool is_hex(const string &str) {
+	return all_of(str.begin(), str.end(), [](char c){ return strchr(hexdigits, c) && c; });
+}
+
+static shared_ptr<const void> map_file(int fd, size_t size) {
+	void *ptr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (ptr == MAP_FAILED)
+		throw runtime_error(format("Could not map message store: {}", strerror(errno)));
+	return shared_ptr<const void>(ptr, [size](const void *ptr) { munmap(const_cast<void *>(ptr), size); });
+}
+
+static bool iequals(std::string_view a, std::string_view b) {
+	return a.size() == b.size() && !strncasecmp(a.data(), b.data(), a.size());
+}
+
+static bool istarts_with(std::string_view str, std::string_view prefix) {
+	return iequals(str.substr(0, prefix.size()), prefix);
+}
+
+static std::string_view trim(std::string_view str) {
+	auto start = str.find_first_not_of(" \t\r\n");
+	if (start == str.npos)
+		return {};
+	auto end = str.find_last_not_of(" \t\r\n");
+	return str.substr(start, end + 1 - start);
+}
+
+namespace LightBTS {
+
+unique_ptr<MessageStore> MessageStore::open(const string &type, const fs::path &dir) {
+	if (type.empty() || type == "files")
+		return unique_ptr<MessageStore>(new FileStore(dir));
+	if (type == "pack")
+		return unique_ptr<MessageStore>(new PackStore(dir));
+	throw runtime_error(format("Invalid message store type {}", type));
+}
+
+/* MessageView */
+
+MessageView::MessageView(shared_ptr<const void> mapping, std::string_view data): mapping(mapping), data(data) {
+	// The headers end at the first empty line.
+	size_t pos = 0;
+
+	while (pos < data.size()) {
+		auto eol = data.find('\n', pos);
+		if (eol == data.npos) {
+			pos = data.size();
+			break;
+		}
+
+		auto line = data.substr(pos, eol - pos);
+		pos = eol + 1;
+
+		if (line.empty() || line == "\r")
+			break;
+	}
+
+	headers = data.substr(0, pos);
+	body = data.substr(pos);
+}
+
+std::string_view MessageView::get_header(std::string_view field) const {
+	size_t pos = 0;
+
+	while (pos < headers.size()) {
+		auto eol = headers.find('\n', pos);
+		if (eol == headers.npos)
+			eol = headers.size();
+
+		auto line = headers.substr(pos, eol - pos);
+		auto colon = line.find(':');
+		auto start = pos;
+		pos = eol + 1;
+
+		if (colon == line.npos || !iequals(line.substr(0, colon), field))
+			continue;
+
+		// Include any continuation lines.
+		while (pos < headers.size() && (headers[pos] == ' ' || headers[pos] == '\t')) {
+			eol = headers.find('\n', pos);
+			if (eol == headers.npos)
+				eol = headers.size();
+			pos = eol + 1;
+		}
+
+		start += colon + 1;
+		return trim(headers.substr(start, min(pos, headers.size()) - start));
+	}
+
+	return {};
+}
+
+bool MessageView::is_plain_text() const {
+	auto type = get_header("Content-Type");
+	if (!type.empty() && !istarts_with(type, "text/plain"))
+		return false;
+
+	auto encoding = get_header("Content-Transfer-Encoding");
+	return encoding.empty() || iequals(encoding, "7bit") || iequals(encoding, "8bit") || iequals(encoding, "binary");
+}
+
+/* FileStore */
+
+fs::path FileStore::path(const string &hash) const {
+	return dir / hash.substr(0, 2) / hash.substr(2);
+}
+
+void FileStore::store(const string &hash, const string &data) {
+	fs::create_directory(dir / hash.substr(0, 2));
+	auto filename = path(hash);
+	ofstream out(filename.string(), ios::binary);
+	out << data;
+	out.close();
+	if (out.fail())
+		throw runtime_error(format("Could not write message file {}", filename.string()));
+}
+
+string FileStore::load(const string &hash) {
+	auto filename = path(hash);
+	ifstream in(filename.string(), ios::binary);
+	if (!in.is_open())
+		throw runtime_error(format("Could not open message file {}", filename.string()));
+	stringstream data;
+	data << in.rdbuf();
+	return data.str();
+}
+
+bool FileStore::exists(const string &hash) {
+	return fs::exists(path(hash));
+}
+
+MessageView FileStore::map(const string &hash) {
+	auto filename = path(hash);
+
+	int fd = ::open(filename.string().c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		throw runtime_error(format("Could not open message file {}", filename.string()));
+
+	struct stat st;
+	if (fstat(fd, &st)) {
+		close(fd);
+		throw runtime_error(format("Could not open message file {}", filename.string()));
+	}
+
+	if (!st.st_size) {
+		close(fd);
+		return MessageView();
+	}
+
+	shared_ptr<const void> mapping;
+	try {
+		mapping = map_file(fd, st.st_size);
+	} catch (...) {
+		close(fd);
+		throw;
+	}
+	close(fd);
+
+	return MessageView(mapping, std::string_view(static_cast<const char *>(mapping.get()), st.st_size));
+}
+
+fs::path FileStore::get_file(const string &hash) {
+	return path(hash);
+}
+
+MessageStore::compact_stats FileStore::compact(const set<string> &live) {
+	compact_stats stats;
+
+	for (auto &&subdir: fs::directory_iterator(dir)) {
+		auto prefix = subdir.path().filename().string();
+		if (prefix.size() != 2 || !is_hex(prefix) || !fs::is_directory(subdir.path()))
+			continue;
+
+		for (auto &&file: fs::directory_iterator(subdir.path())) {
+			auto size = fs::file_size(file.path());
+			stats.bytes_before += size;
+			if (live.count(prefix + file.path().filename().string())) {
+				stats.kept++;
+				stats.bytes_after += size;
+			} else {
+				fs::remove(file.path());
+				stats.dropped++;
+			}
+		}
+
+		if (fs::is_empty(subdir.path()))
+			fs::remove(subdir.path());
+	}
+
+	return stats;
+}
+
+// Files have no record of the order they were stored in, so use their modification times.
+vector<string> FileStore::list() {
+	vector<pair<struct timespec, string>> files;
+
+	for (auto &&subdir: fs::directory_iterator(dir)) {
+		auto prefix = subdir.path().filename().string();
+		if (prefix.size() != 2 || !is_hex(prefix) || !fs::is_directory(subdir.path()))
+			continue;
+
+		for (auto &&file: fs::directory_iterator(subdir.path())) {
+			auto hash = prefix + file.path().filename().string();
+			struct stat st;
+			if (hash.size() != 48 || !is_hex(hash) || stat(file.path().string().c_str(), &st))
+				continue;
+			files.emplace_back(st.st_mtim, hash);
+		}
+	}
+
+	sort(files.begin(), files.end(), [](const pair<struct timespec, string> &a, const pair<struct timespec, string> &b) {
+		if (a.first.tv_sec != b.first.tv_sec)
+			return a.first.tv_sec < b.first.tv_sec;
+		if (a.first.tv_nsec != b.first.tv_nsec)
+			return a.first.tv_nsec < b.first.tv_nsec;
+		return a.second < b.second;
+	});
+
+	vector<string> hashes;
+	for (auto &&file: files)
+		hashes.push_back(move(file.second));
+
+	return hashes;
+}
+
+/* PackStore */
+
+PackStore::~PackStore() {
+	unmap_index();
+	for (auto &&segment: segments)
+		close(segment.second);
+}
+
+void PackStore::map_index() {
+	if (mapping)
+		return;
+
+	index = nullptr;
+	index_size = 0;
+	index_sorted = 0;
+
+	index_inode = 0;
+	index_file_size = 0;
+
+	int fd = ::open((dir / "pack.idx").string().c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return;
+		throw runtime_error(format("Could not open message index: {}", strerror(errno)));
+	}
+
+	struct stat st;
+	if (fstat(fd, &st)) {
+		close(fd);
+		return;
+	}
+
+	index_inode = st.st_ino;
+	index_file_size = st.st_size;
+
+	if ((size_t)st.st_size < sizeof(index_header)) {
+		close(fd);
+		return;
+	}
+
+	void *ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED)
+		throw runtime_error(format("Could not map message index: {}", strerror(errno)));
+
+	mapping = ptr;
+	mapping_size = st.st_size;
+
+	auto header = static_cast<const index_header *>(mapping);
+	if (memcmp(header->magic, "LBTI", 4) || header->version != 1) {
+		unmap_index();
+		throw runtime_error("Message index is corrupt");
+	}
+
+	index = reinterpret_cast<const entry *>(header + 1);
+	index_size = (mapping_size - sizeof *header) / sizeof *index;
+	index_sorted = min<size_t>(header->sorted, index_size);
+}
+
+void PackStore::unmap_index() {
+	if (mapping)
+		munmap(mapping, mapping_size);
+	mapping = nullptr;
+	mapping_size = 0;
+	index = nullptr;
+	index_size = 0;
+	index_sorted = 0;
+	index_inode = 0;
+	index_file_size = 0;
+}
+
+/* Other processes append to pack.idx, or replace it when they compact the store.
+ * If that happened since it was mapped, map it again and return true.
+ * A replaced index means the segments it referred to may be gone,
+ * so they are opened and mapped again as well.
+ */
+bool PackStore::refresh_index() {
+	struct stat st;
+	uint64_t inode = 0;
+	uint64_t size = 0;
+	if (!stat((dir / "pack.idx").string().c_str(), &st)) {
+		inode = st.st_ino;
+		size = st.st_size;
+	}
+
+	if (inode == index_inode && size == index_file_size)
+		return false;
+
+	bool replaced = inode != index_inode;
+
+	unmap_index();
+
+	if (replaced) {
+		for (auto &&segment: segments)
+			close(segment.second);
+		segments.clear();
+		segment_maps.clear();
+	}
+
+	map_index();
+	return true;
+}
+
+const PackStore::entry *PackStore::find(const uint8_t *hash) {
+	map_index();
+
+	auto e = lookup(hash);
+
+	// Not there, or in a segment that has been removed since: check if the index changed.
+	if (!e || (!segments.count(e->segment) && !fs::exists(dir / format("pack-{:06}.dat", e->segment))))
+		if (refresh_index())
+			e = lookup(hash);
+
+	return e;
+}
+
+const PackStore::entry *PackStore::lookup(const uint8_t *hash) const {
+	// Entries appended after the last compaction take precedence.
+	for (size_t i = index_size; i-- > index_sorted;)
+		if (!memcmp(index[i].hash, hash, sizeof index[i].hash))
+			return &index[i];
+
+	auto end = index + index_sorted;
+	auto it = lower_bound(index, end, hash, [](const entry &e, const uint8_t *hash) {
+		return memcmp(e.hash, hash, sizeof e.hash) < 0;
+	});
+
+	if (it != end && !memcmp(it->hash, hash, sizeof it->hash))
+		return it;
+
+	return nullptr;
+}
+
+int PackStore::open_segment(uint32_t segment, bool write) {
+	auto filename = dir / format("pack-{:06}.dat", segment);
+
+	if (write) {
+		int fd = ::open(filename.string().c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+		if (fd == -1)
+			throw runtime_error(format("Could not open {}: {}", filename.string(), strerror(errno)));
+		return fd;
+	}
+
+	auto it = segments.find(segment);
+	if (it != segments.end())
+		return it->second;
+
+	int fd = ::open(filename.string().c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		throw runtime_error(format("Could not open {}: {}", filename.string(), strerror(errno)));
+
+	segments[segment] = fd;
+	return fd;
+}
+
+uint32_t PackStore::last_segment() {
+	uint32_t last = 0;
+
+	for (auto &&file: fs::directory_iterator(dir)) {
+		unsigned int segment;
+		char tail;
+		if (sscanf(file.path().filename().string().c_str(), "pack-%u.da%c", &segment, &tail) == 2 && tail == 't')
+			last = max<uint32_t>(last, segment);
+	}
+
+	return last;
+}
+
+PackStore::entry PackStore::append(int fd, uint32_t segment, const uint8_t *hash, const string &data) {
+	record_header header{};
+	memcpy(header.magic, "LBTM", 4);
+	memcpy(header.hash, hash, sizeof header.hash);
+	header.length = data.size();
+
+	off_t offset = lseek(fd, 0, SEEK_END);
+	if (offset < 0)
+		throw runtime_error(format("Could not seek in message store: {}", strerror(errno)));
+
+	write_all(fd, &header, sizeof header);
+	write_all(fd, data.data(), data.size());
+
+	entry e{};
+	memcpy(e.hash, hash, sizeof e.hash);
+	e.segment = segment;
+	e.offset = offset + sizeof header;
+	e.length = data.size();
+	return e;
+}
+
+void PackStore::store(const string &hash, const string &data) {
+	lock_guard<recursive_mutex> guard(mutex);
+
+	uint8_t raw[24];
+	from_hex(hash, raw, sizeof raw);
+
+	lock_file lock(dir / "pack.lock");
+
+	auto segment = max<uint32_t>(last_segment(), 1);
+	int fd = open_segment(segment, true);
+
+	struct stat st;
+	if (!fstat(fd, &st) && st.st_size && (uintmax_t)st.st_size + sizeof(record_header) + data.size() > max_segment_size) {
+		close(fd);
+		fd = open_segment(++segment, true);
+	}
+
+	entry e;
+	try {
+		e = append(fd, segment, raw, data);
+	} catch (...) {
+		close(fd);
+		throw;
+	}
+	close(fd);
+
+	auto filename = dir / "pack.idx";
+	int idx = ::open(filename.string().c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+	if (idx == -1)
+		throw runtime_error(format("Could not open message index: {}", strerror(errno)));
+
+	try {
+		if (!fstat(idx, &st) && !st.st_size) {
+			index_header header{{'L', 'B', 'T', 'I'}, 1, 0};
+			write_all(idx, &header, sizeof header);
+		}
+		write_all(idx, &e, sizeof e);
+	} catch (...) {
+		close(idx);
+		throw;
+	}
+	close(idx);
+
+	// Make sure the next lookup sees the new entry.
+	unmap_index();
+}
+
+string PackStore::load(const string &hash) {
+	lock_guard<recursive_mutex> guard(mutex);
+
+	uint8_t raw[24];
+	from_hex(hash, raw, sizeof raw);
+
+	auto e = find(raw);
+	if (!e)
+		return FileStore::load(hash);
+
+	string data(e->length, '\0');
+	read_all(open_segment(e->segment), &data[0], e->length, e->offset);
+	return data;
+}
+
+MessageView PackStore::map(const string &hash) {
+	lock_guard<recursive_mutex> guard(mutex);
+
+	uint8_t raw[24];
+	from_hex(hash, raw, sizeof raw);
+
+	auto e = find(raw);
+	if (!e)
+		return FileStore::map(hash);
+
+	// Map whole segments, remapping if it has grown since it was last mapped.
+	auto &segment_map = segment_maps[e->segment];
+	if (e->offset + e->length > segment_map.second) {
+		int fd = open_segment(e->segment);
+		struct stat st;
+		if (fstat(fd, &st))
+			throw runtime_error(format("Could not read from message store: {}", strerror(errno)));
+		if ((uintmax_t)st.st_size < e->offset + e->length)
+			throw runtime_error("Message store is truncated");
+		segment_map.first = map_file(fd, st.st_size);
+		segment_map.second = st.st_size;
+	}
+
+	auto base = static_cast<const char *>(segment_map.first.get());
+	return MessageView(segment_map.first, std::string_view(base + e->offset, e->length));
+}
+
+bool PackStore::exists(const string &hash) {
+	lock_guard<recursive_mutex> guard(mutex);
+
+	uint8_t raw[24];
+	from_hex(hash, raw, sizeof raw);
+	return find(raw) || FileStore::exists(hash);
+}
+
+fs::path PackStore::get_file(const string &hash) {
+	lock_guard<recursive_mutex> guard(mutex);
+
+	uint8_t raw[24];
+	from_hex(hash, raw, sizeof raw);
+	if (!find(raw))
+		return FileStore::get_file(hash);
+
+	auto tmpdir = dir / "tmp";
+	fs::create_directory(tmpdir);
+	auto filename = tmpdir / hash;
+	ofstream out(filename.string(), ios::binary);
+	out << load(hash);
+	out.close();
+	if (out.fail())
+		throw runtime_error(format("Could not write message file {}", filename.string()));
+	return filename;
+}
+
+void PackStore::release_file(const fs::path &path) {
+	if (path.parent_path() == dir / "tmp")
+		fs::remove(path);
+}
+
+MessageStore::compact_stats PackStore::compact(const set<string> &live) {
+	lock_guard<recursive_mutex> guard(mutex);
+
+	compact_stats stats;
+
+	lock_file lock(dir / "pack.lock");
+
+	unmap_index();
+	map_index();
+
+	auto old_last = last_segment();
+	for (uint32_t segment = 1; segment <= old_last; segment++) {
+		auto filename = dir / format("pack-{:06}.dat", segment);
+		if (fs::exists(filename))
+			stats.bytes_before += fs::file_size(filename);
+	}
+	if (mapping)
+		stats.bytes_before += mapping_size;
+
+	// Find the most recent version of each message in the pack.
+	std::map<string, entry> latest;
+	for (size_t i = 0; i < index_size; i++)
+		latest[string(reinterpret_cast<const char *>(index[i].hash), sizeof index[i].hash)] = index[i];
+
+	vector<entry> old_entries;
+	for (auto &&it: latest) {
+		if (live.count(to_hex(it.second.hash, sizeof it.second.hash)))
+			old_entries.push_back(it.second);
+		else
+			stats.dropped++;
+	}
+	stats.dropped += index_size - latest.size();
+
+	// Copy them in their original order, to keep reads sequential.
+	sort(old_entries.begin(), old_entries.end(), [](const entry &a, const entry &b) {
+		return a.segment != b.segment ? a.segment < b.segment : a.offset < b.offset;
+	});
+
+	auto segment = old_last + 1;
+	int fd = open_segment(segment, true);
+	uintmax_t segment_size = 0;
+	vector<uint32_t> new_segments{segment};
+	vector<entry> new_entries;
+	vector<fs::path> loose_files;
+
+	auto copy = [&](const uint8_t *hash, const string &data) {
+		if (segment_size && segment_size + sizeof(record_header) + data.size() > max_segment_size) {
+			if (fsync(fd))
+				throw runtime_error(format("Could not sync message store: {}", strerror(errno)));
+			close(fd);
+			fd = open_segment(++segment, true);
+			new_segments.push_back(segment);
+			segment_size = 0;
+		}
+		new_entries.push_back(append(fd, segment, hash, data));
+		segment_size += sizeof(record_header) + data.size();
+	};
+
+	try {
+		for (auto &&e: old_entries) {
+			string data(e.length, '\0');
+			read_all(open_segment(e.segment), &data[0], e.length, e.offset);
+			copy(e.hash, data);
+			stats.kept++;
+		}
+
+		// Move loose files into the pack.
+		for (auto &&subdir: fs::directory_iterator(dir)) {
+			auto prefix = subdir.path().filename().string();
+			if (prefix.size() != 2 || !is_hex(prefix) || !fs::is_directory(subdir.path()))
+				continue;
+
+			for (auto &&file: fs::directory_iterator(subdir.path())) {
+				auto hash = prefix + file.path().filename().string();
+				stats.bytes_before += fs::file_size(file.path());
+				loose_files.push_back(file.path());
+
+				uint8_t raw[24];
+				if (hash.size() != sizeof raw * 2 || !is_hex(hash) || !live.count(hash)) {
+					stats.dropped++;
+					continue;
+				}
+
+				from_hex(hash, raw, sizeof raw);
+				if (latest.count(string(reinterpret_cast<const char *>(raw), sizeof raw))) {
+					stats.dropped++;
+					continue;
+				}
+
+				copy(raw, FileStore::load(hash));
+				stats.kept++;
+				stats.loose++;
+			}
+		}
+
+		if (fsync(fd))
+			throw runtime_error(format("Could not sync message store: {}", strerror(errno)));
+		close(fd);
+		fd = -1;
+
+		// Write a new, fully sorted index.
+		sort(new_entries.begin(), new_entries.end(), [](const entry &a, const entry &b) {
+			return memcmp(a.hash, b.hash, sizeof a.hash) < 0;
+		});
+
+		auto tmpname = dir / "pack.idx.new";
+		int idx = ::open(tmpname.string().c_str(), O_WRONLY | O_TRUNC | O_CREAT | O_CLOEXEC, 0666);
+		if (idx == -1)
+			throw runtime_error(format("Could not create message index: {}", strerror(errno)));
+
+		try {
+			index_header header{{'L', 'B', 'T', 'I'}, 1, new_entries.size()};
+			write_all(idx, &header, sizeof header);
+			write_all(idx, new_entries.data(), new_entries.size() * sizeof(entry));
+			if (fsync(idx))
+				throw runtime_error(format("Could not sync message index: {}", strerror(errno)));
+		} catch (...) {
+			close(idx);
+			fs::remove(tmpname);
+			throw;
+		}
+		close(idx);
+
+		fs::rename(tmpname, dir / "pack.idx");
+	} catch (...) {
+		if (fd != -1)
+			close(fd);
+		for (auto &&segment: new_segments)
+			fs::remove(dir / format("pack-{:06}.dat", segment));
+		throw;
+	}
+
+	// The new pack is in place, remove everything that has been superseded.
+	unmap_index();
+	for (auto &&segment: segments)
+		close(segment.second);
+	segments.clear();
+	segment_maps.clear();
+
+	for (uint32_t segment = 1; segment <= old_last; segment++)
+		fs::remove(dir / format("pack-{:06}.dat", segment));
+
+	for (auto &&file: loose_files) {
+		fs::remove(file);
+		if (fs::is_empty(file.parent_path()))
+			fs::remove(file.parent_path());
+	}
+
+	for (auto &&segment: new_segments)
+		stats.bytes_after += fs::file_size(dir / format("pack-{:06}.dat", segment));
+	stats.bytes_after += fs::file_size(dir / "pack.idx");
+
+	return stats;
+}
+
+vector<string> PackStore::list() {
+	lock_guard<recursive_mutex> guard(mutex);
+
+	unmap_index();
+	map_index();
+
+	// Only the most recent copy of each message in the pack counts.
+	std::map<string, entry> latest;
+	for (size_t i = 0; i < index_size; i++)
+		latest[string(reinterpret_cast<const char *>(index[i].hash), sizeof index[i].hash)] = index[i];
+
+	vector<entry> entries;
+	for (auto &&it: latest)
+		entries.push_back(it.second);
+
+	sort(entries.begin(), entries.end(), [](const entry &a, const entry &b) {
+		return a.segment != b.segment ? a.segment < b.segment : a.offset < b.offset;
+	});
+
+	// Loose files are left over from before the switch to a pack, so they come first.
+	vector<string> hashes;
+	for (auto &&hash: FileStore::list()) {
+		uint8_t raw[24];
+		from_hex(hash, raw, sizeof raw);
+		if (!latest.count(string(reinterpret_cast<const char *>(raw), sizeof raw)))
+			hashes.push_back(hash);
+	}
+
+	for (auto &&e: entries)
+		hashes.push_back(to_hex(e.hash, sizeof e.hash));
+
+	return hashes;
+}
+
+}
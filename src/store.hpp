@@ -0,0 +1,170 @@
+#pragma once
+
+/* LightBTS -- a lightweight issue tracking system
+   Copyright © 2018 Guus Sliepen <guus@lightbts.info>
+
+   SPDX-License-Identifier: GPL-3.0+
+*/
+
+#include <boost/filesystem.hpp>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace LightBTS {
+
+namespace fs = boost::filesystem;
+
+/* A read-only view of a stored message.
+ * The data is mapped directly from the message store,
+ * all returned string_views point into that mapping and stay valid as long as the view exists.
+ */
+class MessageView {
+	std::shared_ptr<const void> mapping;
+	std::string_view data;
+	std::string_view headers;
+	std::string_view body;
+
+	public:
+	MessageView() {}
+	MessageView(std::shared_ptr<const void> mapping, std::string_view data);
+
+	std::string_view get_data() const { return data; }
+	std::string_view get_body() const { return body; }
+	std::string_view get_header(std::string_view field) const;
+
+	/* Whether the body can be shown as-is,
+	 * without having to decode MIME parts or content transfer encodings.
+	 */
+	bool is_plain_text() const;
+};
+
+/* A message store maps the hash of a Message-ID to the raw message.
+ * All hashes passed to and from a store are hexadecimal strings
+ * as returned by hash_msgid().
+ */
+class MessageStore {
+	protected:
+	fs::path dir;
+
+	public:
+	struct compact_stats {
+		size_t kept = 0;
+		size_t dropped = 0;
+		size_t loose = 0;
+		uintmax_t bytes_before = 0;
+		uintmax_t bytes_after = 0;
+	};
+
+	MessageStore(const fs::path &dir): dir(dir) {}
+	virtual ~MessageStore() {}
+
+	virtual void store(const std::string &hash, const std::string &data) = 0;
+	virtual std::string load(const std::string &hash) = 0;
+	virtual bool exists(const std::string &hash) = 0;
+	virtual MessageView map(const std::string &hash) = 0;
+
+	/* Hooks need a real file to look at.
+	 * A store that does not keep messages in separate files creates a temporary one,
+	 * which is removed again by release_file().
+	 */
+	virtual fs::path get_file(const std::string &hash) = 0;
+	virtual void release_file(const fs::path &) {}
+
+	/* Rewrite the store so it only contains messages whose hash is in live. */
+	virtual compact_stats compact(const std::set<std::string> &live) = 0;
+
+	/* The hashes of all messages in the store, as far as possible in the order they were stored. */
+	virtual std::vector<std::string> list() = 0;
+
+	static std::unique_ptr<MessageStore> open(const std::string &type, const fs::path &dir);
+};
+
+/* The original layout, one file per message, fanned out like git's objects directory. */
+class FileStore: public MessageStore {
+	protected:
+	fs::path path(const std::string &hash) const;
+
+	public:
+	FileStore(const fs::path &dir): MessageStore(dir) {}
+
+	void store(const std::string &hash, const std::string &data) override;
+	std::string load(const std::string &hash) override;
+	bool exists(const std::string &hash) override;
+	MessageView map(const std::string &hash) override;
+	fs::path get_file(const std::string &hash) override;
+	compact_stats compact(const std::set<std::string> &live) override;
+	std::vector<std::string> list() override;
+};
+
+/* Messages are appended to segment files pack-NNNNNN.dat.
+ * The file pack.idx maps each hash to a segment, offset and length.
+ * Its first part is sorted by hash and searched with a binary search,
+ * entries appended since the last compaction are scanned linearly.
+ * Loose files from a FileStore are still read, and moved into the pack by compact().
+ * All public functions are safe to call from multiple threads.
+ */
+class PackStore: public FileStore {
+	struct entry {
+		uint8_t hash[24];
+		uint32_t segment;
+		uint32_t flags;
+		uint64_t offset;
+		uint64_t length;
+	};
+
+	struct index_header {
+		char magic[4];
+		uint32_t version;
+		uint64_t sorted;
+	};
+
+	struct record_header {
+		char magic[4];
+		uint32_t flags;
+		uint8_t hash[24];
+		uint64_t length;
+	};
+
+	void *mapping = nullptr;
+	size_t mapping_size = 0;
+	const entry *index = nullptr;
+	size_t index_size = 0;
+	size_t index_sorted = 0;
+	uint64_t index_inode = 0;   // of the pack.idx that was mapped, to notice when another process changes it
+	uint64_t index_file_size = 0;
+	std::recursive_mutex mutex;
+	std::map<uint32_t, int> segments;
+	std::map<uint32_t, std::pair<std::shared_ptr<const void>, size_t>> segment_maps;
+
+	void map_index();
+	void unmap_index();
+	bool refresh_index();
+	const entry *lookup(const uint8_t *hash) const;
+	const entry *find(const uint8_t *hash);
+	int open_segment(uint32_t segment, bool write = false);
+	uint32_t last_segment();
+	entry append(int fd, uint32_t segment, const uint8_t *hash, const std::string &data);
+
+	public:
+	static const uintmax_t max_segment_size = 256 << 20;
+
+	PackStore(const fs::path &dir): FileStore(dir) {}
+	~PackStore();
+
+	void store(const std::string &hash, const std::string &data) override;
+	std::string load(const std::string &hash) override;
+	bool exists(const std::string &hash) override;
+	MessageView map(const std::string &hash) override;
+	fs::path get_file(const std::string &hash) override;
+	void release_file(const fs::path &path) override;
+	compact_stats compact(const std::set<std::string> &live) override;
+	std::vector<std::string> list() override;
+};
+
+}
@@ -0,0 +1,911 @@
+/* LightBTS -- a lightweight issue tracking system
+   Copyright © 2018 Guus Sliepen <guus@lightbts.info>
+
+   SPDX-License-Identifier: GPL-3.0+
+*/
+
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <limits.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <boost/algorithm/string.hpp>
+#include <fmt/ostream.h>
+
+#include "web.hpp"
+
+#include "cli.hpp"
+#include "lightbts.hpp"
+#include "mustache.hpp"
+#include "templates.hpp"
+#include "writer.hpp"
+
+using namespace std;
+using namespace fmt;
+using namespace boost::algorithm;
+
+/* lbts web is a small HTTP/1.1 server.
+ * The main thread runs an epoll loop that accepts connections, reads requests and writes responses.
+ * Complete requests are handed to a pool of workers, each with its own read-only instance,
+ * which render the response and pass it back to the main thread, waking it up through an eventfd.
+ * A connection has at most one request in flight, pipelined requests wait in its input buffer.
+ *
+ * Pages are rendered with the compiled versions of the built-in templates,
+ * unless the instance's template directory has a modified copy.
+ * The response body is a Writer, which is sent with a single sendmsg() together with the header
+ * whenever the socket allows it, without first joining the pieces of the body.
+ */
+
+static const size_t max_header_size = 64 * 1024;
+static const size_t max_body_size = 1024 * 1024;
+static const size_t max_input_size = max_header_size + max_body_size;
+
+struct request {
+	string method;
+	string path;
+	string query;
+	bool http10 = false;  // HTTP/1.0 connections are only kept alive if the response says so
+	bool keep_alive = true;
+};
+
+struct response {
+	int status = 200;
+	string content_type = "text/html; charset=utf-8";
+	string headers;
+	LightBTS::Writer body;
+};
+
+// Settings shared by all workers, they do not change while the server runs.
+struct site_config {
+	string root_path;    // the path part of web.root, requests outside it are not found
+	string root;         // web.root, for links to pages
+	string static_root;  // web.static-root, or web.root if that is not set, for links to the stylesheet
+	string copyright;
+};
+
+struct job {
+	uint64_t connection;
+	request req;
+};
+
+struct completion {
+	uint64_t connection;
+	string head;
+	LightBTS::Writer body;  // empty for HEAD requests
+	bool keep_alive;
+};
+
+static const char *reason(int status) {
+	switch (status) {
+	case 200: return "OK";
+	case 400: return "Bad Request";
+	case 404: return "Not Found";
+	case 405: return "Method Not Allowed";
+	case 413: return "Payload Too Large";
+	case 431: return "Request Header Fields Too Large";
+	case 500: return "Internal Server Error";
+	case 501: return "Not Implemented";
+	case 505: return "HTTP Version Not Supported";
+	default: return "Unknown";
+	}
+}
+
+static response error_response(int status, const string &message) {
+	response resp;
+	resp.status = status;
+	resp.content_type = "text/plain; charset=utf-8";
+	resp.body.copy(message);
+	return resp;
+}
+
+// The status line and header fields of a response.
+static string format_head(const response &resp, bool keep_alive, bool http10 = false) {
+	char date[64];
+	time_t now = time(nullptr);
+	struct tm tm;
+	gmtime_r(&now, &tm);
+	strftime(date, sizeof date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+	return format("HTTP/1.1 {} {}\r\nDate: {}\r\nContent-Type: {}\r\nContent-Length: {}\r\n{}{}\r\n",
+	              resp.status, reason(resp.status), date, resp.content_type, resp.body.size(),
+	              resp.headers, !keep_alive ? "Connection: close\r\n" : http10 ? "Connection: keep-alive\r\n" : "");
+}
+
+/* Parse the request at the start of the input buffer.
+ * Returns 0 if it is not complete yet, 200 if it is, or the status of the error response to send.
+ * The length of a complete request, including any body, is stored in length.
+ */
+static int parse_request(const string &in, request &req, size_t &length) {
+	auto end = in.find("\r\n\r\n");
+	if (end == in.npos)
+		return in.size() > max_header_size ? 431 : 0;
+	if (end > max_header_size)
+		return 431;
+
+	std::string_view head(in.data(), end);
+	auto eol = head.find("\r\n");
+	auto line = head.substr(0, eol);
+
+	auto first_space = line.find(' ');
+	auto last_space = line.rfind(' ');
+	if (first_space == line.npos || first_space == last_space)
+		return 400;
+
+	req.method = string(line.substr(0, first_space));
+	auto target = line.substr(first_space + 1, last_space - first_space - 1);
+	auto version = line.substr(last_space + 1);
+
+	req.http10 = version == "HTTP/1.0";
+	if (version == "HTTP/1.1")
+		req.keep_alive = true;
+	else if (req.http10)
+		req.keep_alive = false;
+	else
+		return 505;
+
+	auto question = target.find('?');
+	req.path = string(target.substr(0, question));
+	req.query = question == target.npos ? "" : string(target.substr(question + 1));
+
+	size_t content_length = 0;
+
+	while (eol != head.npos) {
+		auto start = eol + 2;
+		eol = head.find("\r\n", start);
+		auto field = head.substr(start, eol == head.npos ? head.npos : eol - start);
+
+		auto colon = field.find(':');
+		if (colon == field.npos)
+			return 400;
+
+		auto name = to_lower_copy(string(field.substr(0, colon)));
+		auto value = to_lower_copy(trim_copy(string(field.substr(colon + 1))));
+
+		if (name == "connection") {
+			if (value.find("close") != value.npos)
+				req.keep_alive = false;
+			else if (value.find("keep-alive") != value.npos)
+				req.keep_alive = true;
+		} else if (name == "content-length") {
+			if (value.empty() || value.find_first_not_of("0123456789") != value.npos)
+				return 400;
+			if (value.size() > 9 || stoul(value) > max_body_size)
+				return 413;
+			content_length = stoul(value);
+		} else if (name == "transfer-encoding") {
+			return 501;
+		}
+	}
+
+	// Request bodies are not used, but they must be skipped.
+	if (in.size() < end + 4 + content_length)
+		return 0;
+
+	length = end + 4 + content_length;
+	return 200;
+}
+
+static string url_decode(std::string_view str) {
+	string result;
+
+	for (size_t i = 0; i < str.size(); i++) {
+		if (str[i] == '+') {
+			result += ' ';
+		} else if (str[i] == '%' && i + 2 < str.size() && isxdigit((unsigned char)str[i + 1]) && isxdigit((unsigned char)str[i + 2])) {
+			result += char(stoi(string(str.substr(i + 1, 2)), nullptr, 16));
+			i += 2;
+		} else {
+			result += str[i];
+		}
+	}
+
+	return result;
+}
+
+static map<string, string> parse_query(const string &query) {
+	map<string, string> result;
+	vector<string> parts;
+	split(parts, query, is_any_of("&"), token_compress_on);
+
+	for (auto &&part: parts) {
+		if (part.empty())
+			continue;
+		auto equals = part.find('=');
+		result[url_decode(std::string_view(part).substr(0, equals))] = equals == part.npos ? "" : url_decode(std::string_view(part).substr(equals + 1));
+	}
+
+	return result;
+}
+
+static string get_body(LightBTS::Instance &bts, const LightBTS::MessageSummary &summary) {
+	if (summary.complete)
+		return summary.snippet;
+
+	auto message = bts.get_message_view(summary.msgid);
+	if (message.is_plain_text())
+		return string(message.get_body());
+
+	return bts.get_message(summary.msgid).get_text();
+}
+
+static response render_list(LightBTS::Instance &bts, const site_config &site) {
+	response resp;
+	resp.headers = "Cache-Control: no-cache\r\n";
+
+	if (bts.is_builtin_template("main.html")) {
+		// The cursor reuses its ticket, the page refers to copies.
+		vector<LightBTS::Ticket> tickets;
+		for (auto &&ticket: bts.list_cursor())
+			tickets.push_back(ticket);
+
+		LightBTS::Templates::main_html page;
+		page.root = site.static_root;
+		page.copyright = site.copyright;
+
+		for (auto &&ticket: tickets) {
+			auto &bug = page.bugs.emplace_back();
+			bug.id = ticket.get_id();
+			bug.status = LightBTS::status_names[static_cast<int>(ticket.get_status())];
+			bug.severity = LightBTS::severity_names[static_cast<int>(ticket.get_severity())];
+			bug.title = ticket.get_title();
+		}
+
+		page.render(resp.body);
+		return resp;
+	}
+
+	LightBTS::Mustache::Context context;
+	context.set("root", site.static_root);
+	context.set("copyright", site.copyright);
+
+	auto &bugs = context.list("bugs");
+	for (auto &&ticket: bts.list_cursor()) {
+		LightBTS::Mustache::Context bug;
+		bug.set("id", ticket.get_id());
+		bug.set("status", ticket.get_status_name());
+		bug.set("severity", ticket.get_severity_name());
+		bug.set("title", ticket.get_title());
+		bugs.push_back(move(bug));
+	}
+
+	bts.get_compiled_template("main.html")->render(context, resp.body);
+	return resp;
+}
+
+static response render_bug(LightBTS::Instance &bts, const site_config &site, const string &id) {
+	if (id.empty() || id.find_first_not_of("0123456789") != id.npos)
+		return error_response(400, "Exactly one bug id should be specified.\n");
+
+	auto ticket = bts.get_ticket(id);
+	if (ticket.get_id().empty())
+		return error_response(404, format("Bug {} does not exist.\n", id));
+
+	response resp;
+	resp.headers = "Cache-Control: no-cache\r\n";
+
+	auto summaries = bts.get_message_summaries(ticket);
+
+	if (bts.is_builtin_template("bug.html")) {
+		// The page refers to these, so they must be complete before it is filled in.
+		vector<string> bodies;
+		for (auto &&summary: summaries)
+			bodies.push_back(get_body(bts, summary));
+
+		LightBTS::Templates::bug_html page;
+		page.id = ticket.get_id();
+		page.title = ticket.get_title();
+		page.status = LightBTS::status_names[static_cast<int>(ticket.get_status())];
+		page.severity = LightBTS::severity_names[static_cast<int>(ticket.get_severity())];
+		page.root = site.static_root;
+		page.copyright = site.copyright;
+
+		for (size_t i = 0; i < summaries.size(); i++) {
+			auto &message = page.messages.emplace_back();
+			message.from = summaries[i].from;
+			message.to = summaries[i].to;
+			message.subject = summaries[i].subject;
+			message.date = summaries[i].date_text;
+			message.body = bodies[i];
+		}
+
+		if (!summaries.empty()) {
+			page.submitter = summaries.front().from;
+			page.date = summaries.front().date_text;
+		}
+
+		page.render(resp.body);
+		return resp;
+	}
+
+	LightBTS::Mustache::Context context;
+	context.set("id", ticket.get_id());
+	context.set("title", ticket.get_title());
+	context.set("status", ticket.get_status_name());
+	context.set("severity", ticket.get_severity_name());
+	context.set("root", site.static_root);
+	context.set("copyright", site.copyright);
+
+	auto &messages = context.list("messages");
+	messages.reserve(summaries.size());
+	for (auto &&summary: summaries) {
+		LightBTS::Mustache::Context message;
+		message.set("msgid", summary.msgid);
+		message.set("from", summary.from);
+		message.set("to", summary.to);
+		message.set("subject", summary.subject);
+		message.set("date", summary.date_text);
+		message.set("parent", summary.parent);
+		message.set("depth", to_string(summary.depth));
+		message.set("body", get_body(bts, summary));
+		messages.push_back(move(message));
+	}
+
+	if (!messages.empty()) {
+		context.set("submitter", messages.front().values["from"]);
+		context.set("date", messages.front().values["date"]);
+	}
+
+	bts.get_compiled_template("bug.html")->render(context, resp.body);
+	return resp;
+}
+
+static response handle_request(LightBTS::Instance &bts, const site_config &site, const request &req) {
+	if (req.method != "GET" && req.method != "HEAD") {
+		auto resp = error_response(405, "Only GET and HEAD requests are supported.\n");
+		resp.headers = "Allow: GET, HEAD\r\n";
+		return resp;
+	}
+
+	if (!starts_with(req.path, site.root_path))
+		return error_response(404, "Not found.\n");
+
+	auto page = req.path.substr(site.root_path.size());
+
+	if (page == "lightbts.css") {
+		response resp;
+		resp.content_type = "text/css; charset=utf-8";
+		resp.headers = "Cache-Control: max-age=3600\r\n";
+		if (bts.is_builtin_template("lightbts.css"))
+			LightBTS::Templates::lightbts_css().render(resp.body);
+		else
+			resp.body.copy(bts.get_template("lightbts.css"));
+		return resp;
+	}
+
+	if (!page.empty())
+		return error_response(404, "Not found.\n");
+
+	auto query = parse_query(req.query);
+	auto bug = query.find("bug");
+	if (bug != query.end())
+		return render_bug(bts, site, bug->second);
+	else
+		return render_list(bts, site);
+}
+
+/* Requests waiting for a worker.
+ * pop() blocks until there is a job, and returns false when the server stops.
+ */
+class job_queue {
+	mutex lock;
+	condition_variable cond;
+	deque<job> jobs;
+	bool stopping = false;
+
+	public:
+	void push(job &&j) {
+		{
+			lock_guard<mutex> guard(lock);
+			jobs.push_back(move(j));
+		}
+		cond.notify_one();
+	}
+
+	bool pop(job &j) {
+		unique_lock<mutex> guard(lock);
+		cond.wait(guard, [&] { return stopping || !jobs.empty(); });
+		if (jobs.empty())
+			return false;
+		j = move(jobs.front());
+		jobs.pop_front();
+		return true;
+	}
+
+	void stop() {
+		{
+			lock_guard<mutex> guard(lock);
+			stopping = true;
+		}
+		cond.notify_all();
+	}
+};
+
+// Responses waiting to be sent by the main thread.
+class completion_queue {
+	mutex lock;
+	deque<completion> completions;
+	int event_fd;
+
+	public:
+	completion_queue(int event_fd): event_fd(event_fd) {}
+
+	void push(completion &&c) {
+		{
+			lock_guard<mutex> guard(lock);
+			completions.push_back(move(c));
+		}
+		uint64_t one = 1;
+		if (write(event_fd, &one, sizeof one) != sizeof one && errno != EAGAIN)
+			print(cerr, "Could not wake up the web server: {}\n", strerror(errno));
+	}
+
+	deque<completion> take() {
+		uint64_t count;
+		if (read(event_fd, &count, sizeof count) < 0 && errno != EAGAIN)
+			print(cerr, "Could not read from eventfd: {}\n", strerror(errno));
+		deque<completion> result;
+		lock_guard<mutex> guard(lock);
+		result.swap(completions);
+		return result;
+	}
+};
+
+static void worker(unique_ptr<LightBTS::Instance> bts, const site_config &site, job_queue &jobs, completion_queue &completions) {
+	job j;
+
+	while (jobs.pop(j)) {
+		response resp;
+
+		try {
+			// Pick up configuration changes and rebuilt indexes.
+			if (bts->is_stale())
+				bts = make_unique<LightBTS::Instance>(data_dir, LightBTS::Instance::READ_ONLY);
+			resp = handle_request(*bts, site, j.req);
+		} catch (exception &e) {
+			print(cerr, "Error handling request for {}: {}\n", j.req.path, e.what());
+			resp = error_response(500, "Internal server error.\n");
+		}
+
+		completion c{j.connection, format_head(resp, j.req.keep_alive, j.req.http10), {}, j.req.keep_alive};
+		if (j.req.method != "HEAD")
+			c.body = move(resp.body);
+		completions.push(move(c));
+	}
+}
+
+struct connection {
+	int fd;
+	string in;
+	string head;               // the response being sent
+	LightBTS::Writer body;
+	vector<iovec> out;         // the parts of head and body that have not been sent yet
+	size_t out_pos = 0;        // the first element of out that has not been sent completely
+	bool busy = false;         // a worker is handling a request from this connection
+	bool keep_alive = true;    // false once a response that closes the connection is queued
+	bool peer_closed = false;  // the client has shut down its side, but still expects responses
+	uint32_t events = EPOLLIN; // the events we are waiting for
+	chrono::steady_clock::time_point last_active;
+
+	void set_response(string &&h, LightBTS::Writer &&b) {
+		head = move(h);
+		body = move(b);
+		out.clear();
+		out.push_back({&head[0], head.size()});
+		for (auto &&iov: body.get_iovecs())
+			out.push_back(iov);
+		out_pos = 0;
+	}
+
+	void clear_response() {
+		head.clear();
+		body = {};
+		out.clear();
+		out_pos = 0;
+	}
+};
+
+static volatile sig_atomic_t stop_requested;
+
+static void stop_handler(int) {
+	stop_requested = 1;
+}
+
+// Split [address]:port, address:port or port.
+static void parse_address(const string &arg, string &address, string &port) {
+	auto colon = arg.rfind(':');
+	if (colon == arg.npos) {
+		port = arg;
+		return;
+	}
+
+	address = arg.substr(0, colon);
+	port = arg.substr(colon + 1);
+	if (address.size() >= 2 && address.front() == '[' && address.back() == ']')
+		address = address.substr(1, address.size() - 2);
+}
+
+static int listen_on(const string &address, const string &port) {
+	addrinfo hints{};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	addrinfo *ai;
+	int err = getaddrinfo(address.empty() ? nullptr : address.c_str(), port.c_str(), &hints, &ai);
+	if (err)
+		throw runtime_error(format("Could not resolve {}:{}: {}", address, port, gai_strerror(err)));
+
+	int fd = -1;
+	string error;
+
+	for (auto p = ai; p; p = p->ai_next) {
+		fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, p->ai_protocol);
+		if (fd == -1)
+			continue;
+
+		int one = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+
+		if (!bind(fd, p->ai_addr, p->ai_addrlen) && !listen(fd, 128))
+			break;
+
+		error = strerror(errno);
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(ai);
+
+	if (fd == -1)
+		throw runtime_error(format("Could not listen on {}:{}: {}", address, port, error));
+
+	return fd;
+}
+
+// The path part of web.root, starting and ending with a slash.
+static string root_path(const string &root) {
+	string path = root;
+
+	auto scheme = path.find("://");
+	if (scheme != path.npos) {
+		auto slash = path.find('/', scheme + 3);
+		path = slash == path.npos ? "" : path.substr(slash);
+	}
+
+	if (path.empty() || path.front() != '/')
+		path.insert(path.begin(), '/');
+	if (path.back() != '/')
+		path.push_back('/');
+
+	return path;
+}
+
+int do_web(const char *argv0, const vector<string> &args) {
+	if (args.size() > 1) {
+		print(cerr, "Too many arguments\n");
+		return 1;
+	}
+
+	string address = "localhost";
+	string port = "8080";
+	if (!args.empty())
+		parse_address(args[0], address, port);
+
+	unsigned int workers = jobs ? jobs : min(4u, max(1u, thread::hardware_concurrency()));
+
+	// Open all instances up front, so problems are reported before the server starts.
+	vector<unique_ptr<LightBTS::Instance>> instances;
+	for (unsigned int i = 0; i < workers; i++)
+		instances.push_back(make_unique<LightBTS::Instance>(data_dir, LightBTS::Instance::READ_ONLY));
+
+	site_config site;
+	site.root = instances.front()->get_config("web", "root");
+	site.root_path = root_path(site.root);
+	site.static_root = instances.front()->get_config("web", "static-root");
+	if (site.static_root.empty())
+		site.static_root = site.root;
+	site.copyright = format("LightBTS {}, copyright (c) 2014-2018 Guus Sliepen", lightbts_version);
+
+	int listen_fd = listen_on(address, port);
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	int event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epoll_fd == -1 || event_fd == -1)
+		throw runtime_error(format("Could not set up the event loop: {}", strerror(errno)));
+
+	// Connections are identified by a counter, so a late response can never go to a reused file descriptor.
+	enum : uint64_t {
+		LISTEN_ID,
+		EVENT_ID,
+		FIRST_CONNECTION_ID,
+	};
+
+	epoll_event ev{};
+	ev.events = EPOLLIN;
+	ev.data.u64 = LISTEN_ID;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+	ev.data.u64 = EVENT_ID;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_fd, &ev);
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, stop_handler);
+	signal(SIGTERM, stop_handler);
+
+	job_queue jobs;
+	completion_queue completions(event_fd);
+	vector<thread> threads;
+	for (auto &&instance: instances)
+		threads.emplace_back(worker, move(instance), cref(site), ref(jobs), ref(completions));
+
+	if (verbose)
+		print(cerr, "Serving on {}:{} with {} workers\n", address, port, workers);
+
+	auto idle_timeout = chrono::seconds(30);
+	map<uint64_t, connection> connections;
+	uint64_t next_id = FIRST_CONNECTION_ID;
+
+	/* When we run out of file descriptors, the listening socket stays readable.
+	 * It is removed from the event loop until a connection is closed, instead of waking us up over and over.
+	 */
+	bool accepting = true;
+
+	auto resume_accepting = [&]() {
+		if (accepting)
+			return;
+		epoll_event ev{};
+		ev.events = EPOLLIN;
+		ev.data.u64 = LISTEN_ID;
+		accepting = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) == 0;
+	};
+
+	auto close_connection = [&](uint64_t id) {
+		auto it = connections.find(id);
+		if (it == connections.end())
+			return;
+		close(it->second.fd);
+		connections.erase(it);
+		resume_accepting();
+	};
+
+	auto update_events = [&](uint64_t id, connection &conn) {
+		uint32_t events = (conn.peer_closed ? 0 : EPOLLIN) | (conn.out_pos < conn.out.size() ? EPOLLOUT : 0);
+		if (events == conn.events)
+			return;
+		conn.events = events;
+		epoll_event ev{};
+		ev.events = events;
+		ev.data.u64 = id;
+		epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn.fd, &ev);
+	};
+
+	// Send as much of the pending output as possible. Returns false if the connection was closed.
+	auto flush = [&](uint64_t id, connection &conn) {
+		while (conn.out_pos < conn.out.size()) {
+			msghdr msg{};
+			msg.msg_iov = &conn.out[conn.out_pos];
+			msg.msg_iovlen = min(conn.out.size() - conn.out_pos, size_t(IOV_MAX));
+			auto sent = sendmsg(conn.fd, &msg, MSG_NOSIGNAL);
+			if (sent < 0 && errno == EINTR)
+				continue;
+			if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				break;
+			if (sent <= 0) {
+				close_connection(id);
+				return false;
+			}
+
+			// Skip what has been sent, the last piece may have been sent partially.
+			size_t left = sent;
+			while (conn.out_pos < conn.out.size() && left >= conn.out[conn.out_pos].iov_len)
+				left -= conn.out[conn.out_pos++].iov_len;
+			if (left) {
+				auto &iov = conn.out[conn.out_pos];
+				iov.iov_base = static_cast<char *>(iov.iov_base) + left;
+				iov.iov_len -= left;
+			}
+		}
+
+		if (conn.out_pos < conn.out.size()) {
+			update_events(id, conn);
+			return true;
+		}
+
+		conn.clear_response();
+		update_events(id, conn);
+
+		if (!conn.keep_alive) {
+			close_connection(id);
+			return false;
+		}
+
+		return true;
+	};
+
+	/* Start handling the next request in the input buffer, if there is one and we are not busy.
+	 * Returns false if the connection was closed.
+	 */
+	auto process = [&](uint64_t id, connection &conn) {
+		if (conn.busy || !conn.out.empty() || !conn.keep_alive)
+			return true;
+
+		request req;
+		size_t length = 0;
+		int status = parse_request(conn.in, req, length);
+
+		if (!status) {
+			// A client that has shut down its side cannot complete the request.
+			if (conn.peer_closed) {
+				close_connection(id);
+				return false;
+			}
+			return true;
+		}
+
+		if (status != 200) {
+			conn.keep_alive = false;
+			auto resp = error_response(status, format("{}.\n", reason(status)));
+			conn.set_response(format_head(resp, false), move(resp.body));
+			conn.in.clear();
+			return flush(id, conn);
+		}
+
+		conn.in.erase(0, length);
+		conn.busy = true;
+		jobs.push({id, move(req)});
+		return true;
+	};
+
+	auto last_sweep = chrono::steady_clock::now();
+
+	while (!stop_requested) {
+		epoll_event events[64];
+		int count = epoll_wait(epoll_fd, events, 64, 1000);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			print(cerr, "Error waiting for events: {}\n", strerror(errno));
+			break;
+		}
+
+		auto now = chrono::steady_clock::now();
+
+		for (int i = 0; i < count; i++) {
+			auto id = events[i].data.u64;
+
+			if (id == LISTEN_ID) {
+				while (true) {
+					int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+					if (fd == -1 && (errno == EINTR || errno == ECONNABORTED))
+						continue;
+					if (fd == -1 && (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)) {
+						print(cerr, "Could not accept a connection: {}\n", strerror(errno));
+						epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listen_fd, nullptr);
+						accepting = false;
+					}
+					if (fd == -1)
+						break;
+
+					auto conn_id = next_id++;
+					auto &conn = connections[conn_id];
+					conn.fd = fd;
+					conn.last_active = now;
+
+					epoll_event ev{};
+					ev.events = EPOLLIN;
+					ev.data.u64 = conn_id;
+					epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+				}
+				continue;
+			}
+
+			if (id == EVENT_ID) {
+				for (auto &&c: completions.take()) {
+					auto it = connections.find(c.connection);
+					if (it == connections.end())
+						continue;
+					auto &conn = it->second;
+					conn.busy = false;
+					conn.keep_alive = c.keep_alive;
+					conn.last_active = now;
+					conn.set_response(move(c.head), move(c.body));
+					if (flush(c.connection, conn))
+						process(c.connection, conn);
+				}
+				continue;
+			}
+
+			auto it = connections.find(id);
+			if (it == connections.end())
+				continue;
+			auto &conn = it->second;
+			conn.last_active = now;
+
+			// The connection is gone in both directions, any response still being made is dropped.
+			if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+				close_connection(id);
+				continue;
+			}
+
+			if (events[i].events & EPOLLOUT) {
+				if (!flush(id, conn) || !process(id, conn))
+					continue;
+			}
+
+			if (events[i].events & EPOLLIN) {
+				char buf[16384];
+				bool failed = false;
+
+				while (true) {
+					auto received = recv(conn.fd, buf, sizeof buf, 0);
+					if (received < 0 && errno == EINTR)
+						continue;
+					if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+						break;
+					if (received < 0) {
+						failed = true;
+						break;
+					}
+					if (received == 0) {
+						/* The client has sent all its requests, but may still be waiting for the responses.
+						 * They are handled first, the connection is closed once they have been sent.
+						 */
+						conn.peer_closed = true;
+						update_events(id, conn);
+						break;
+					}
+					conn.in.append(buf, received);
+				}
+
+				// Nothing we accept is this large, not even a full pipeline of requests.
+				if (failed || conn.in.size() > max_input_size) {
+					close_connection(id);
+					continue;
+				}
+
+				process(id, conn);
+			}
+		}
+
+		// Close connections that have been idle for too long.
+		if (now - last_sweep >= chrono::seconds(1)) {
+			last_sweep = now;
+			resume_accepting();
+			for (auto it = connections.begin(); it != connections.end();) {
+				auto &conn = it->second;
+				if (!conn.busy && conn.out.empty() && now - conn.last_active > idle_timeout) {
+					close(conn.fd);
+					it = connections.erase(it);
+					resume_accepting();
+				} else {
+					++it;
+				}
+			}
+		}
+	}
+
+	jobs.stop();
+	for (auto &&t: threads)
+		t.join();
+
+	for (auto &&it: connections)
+		close(it.second.fd);
+	close(listen_fd);
+	close(event_fd);
+	close(epoll_fd);
+
+	return 0;
+}
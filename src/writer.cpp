@@ -0,0 +1,70 @@
+/* LightBTS -- a lightweight issue tracking system
+   Copyright © 2018 Guus Sliepen <guus@lightbts.info>
+
+   SPDX-License-Identifier: GPL-3.0+
+*/
+
+#include "writer.hpp"
+
+#include "mustache.hpp"
+
+using namespace std;
+
+namespace LightBTS {
+
+// Short pieces are cheaper to copy than to write separately.
+static const size_t min_reference_size = 64;
+
+void Writer::append_buffer(size_t offset, size_t size) {
+	if (!size)
+		return;
+
+	total += size;
+
+	if (!pieces.empty() && !pieces.back().data && pieces.back().offset + pieces.back().size == offset)
+		pieces.back().size += size;
+	else
+		pieces.push_back({nullptr, offset, size});
+}
+
+void Writer::text(std::string_view str) {
+	if (str.size() < min_reference_size)
+		return copy(str);
+
+	pieces.push_back({str.data(), 0, str.size()});
+	total += str.size();
+}
+
+void Writer::copy(std::string_view str) {
+	auto offset = buffer.size();
+	buffer.append(str);
+	append_buffer(offset, str.size());
+}
+
+void Writer::escape(std::string_view str) {
+	auto offset = buffer.size();
+	Mustache::escape_html(str, buffer);
+	append_buffer(offset, buffer.size() - offset);
+}
+
+vector<iovec> Writer::get_iovecs() const {
+	vector<iovec> result;
+	result.reserve(pieces.size());
+
+	for (auto &&p: pieces)
+		result.push_back({const_cast<char *>(p.data ? p.data : buffer.data() + p.offset), p.size});
+
+	return result;
+}
+
+string Writer::str() const {
+	string result;
+	result.reserve(total);
+
+	for (auto &&p: pieces)
+		result.append(p.data ? p.data : buffer.data() + p.offset, p.size);
+
+	return result;
+}
+
+}
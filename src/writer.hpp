@@ -0,0 +1,46 @@
+#pragma once
+
+/* LightBTS -- a lightweight issue tracking system
+   Copyright © 2018 Guus Sliepen <guus@lightbts.info>
+
+   SPDX-License-Identifier: GPL-3.0+
+*/
+
+#include <string>
+#include <string_view>
+#include <sys/uio.h>
+#include <vector>
+
+namespace LightBTS {
+
+/* Output of a rendered template, as a list of pieces that can be written with writev().
+ * Static text of compiled templates is referenced, not copied.
+ * Everything else is copied into a single buffer, so the writer does not depend on the data it was rendered from.
+ */
+class Writer {
+	struct piece {
+		const char *data;  // nullptr if the piece is in the buffer
+		size_t offset;     // offset in the buffer
+		size_t size;
+	};
+
+	std::vector<piece> pieces;
+	std::string buffer;
+	size_t total = 0;
+
+	void append_buffer(size_t offset, size_t size);
+
+	public:
+	// The text must stay valid as long as the writer is used, like the string literals of compiled templates.
+	void text(std::string_view str);
+	void copy(std::string_view str);
+	void escape(std::string_view str);
+
+	size_t size() const { return total; }
+
+	// The returned pointers are valid until the writer is changed.
+	std::vector<iovec> get_iovecs() const;
+	std::string str() const;
+};
+
+}